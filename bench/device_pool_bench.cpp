@@ -0,0 +1,113 @@
+// Measures allocation churn through DevicePool against calling hipMalloc/hipFree directly, with a stub HIP allocator that charges a fixed
+// latency per call, as a real device allocation (and the synchronisation in hipFree) would.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "device_pool.h"
+
+using namespace utpx;
+
+static constexpr auto mallocLatency = std::chrono::microseconds(50), freeLatency = std::chrono::microseconds(30);
+static size_t deviceCapacity, deviceUsed, mallocCalls;
+
+static void spin(std::chrono::nanoseconds duration) {
+  auto end = std::chrono::steady_clock::now() + duration;
+  while (std::chrono::steady_clock::now() < end) {}
+}
+
+// Device memory is never touched, so plain address space stands in for it.
+static hipError_t stubMalloc(void **ptr, size_t size) {
+  spin(mallocLatency);
+  if (deviceUsed + size > deviceCapacity) return hipErrorOutOfMemory;
+  mallocCalls++;
+  deviceUsed += size;
+  *ptr = reinterpret_cast<void *>(std::malloc(sizeof(size_t)));
+  *static_cast<size_t *>(*ptr) = size;
+  return hipSuccess;
+}
+
+static hipError_t stubFree(void *ptr) {
+  spin(freeLatency);
+  deviceUsed -= *static_cast<size_t *>(ptr);
+  std::free(ptr);
+  return hipSuccess;
+}
+
+static hipError_t stubEventCreate(hipEvent_t *event, unsigned) {
+  *event = reinterpret_cast<hipEvent_t>(std::malloc(1));
+  return hipSuccess;
+}
+static hipError_t stubEventRecord(hipEvent_t, hipStream_t) { return hipSuccess; }
+static hipError_t stubEventSynchronize(hipEvent_t) { return hipSuccess; }
+static hipError_t stubStreamWaitEvent(hipStream_t, hipEvent_t, unsigned) { return hipSuccess; }
+
+struct Result {
+  double usPerIteration;
+  double hitRate;
+};
+
+// Every iteration allocates one temporary per size returned by sizes(iteration) and then frees them all, as a StdPar loop body would.
+template <typename Allocate, typename Release, typename Sizes>
+static Result churn(size_t iterations, Allocate allocate, Release release, Sizes sizes) {
+  mallocCalls = 0;
+  size_t requests = 0;
+  std::vector<std::pair<void *, size_t>> live;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    for (auto size : sizes(i)) {
+      void *ptr{};
+      if (allocate(&ptr, size) != hipSuccess) std::abort();
+      live.emplace_back(ptr, size);
+      requests++;
+    }
+    for (auto [ptr, size] : live)
+      release(ptr, size);
+    live.clear();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  return {double(elapsed) / 1000.0 / double(iterations), 1.0 - double(mallocCalls) / double(requests)};
+}
+
+int main() {
+  constexpr size_t iterations = 2000, MB = 1 << 20;
+  const DevicePool::Api api{stubMalloc, stubFree, stubEventCreate, stubEventRecord, stubEventSynchronize, stubStreamWaitEvent};
+  std::mt19937_64 rng(42);
+
+  struct Workload {
+    const char *name;
+    size_t capacity;
+    std::vector<size_t> (*sizes)(size_t, std::mt19937_64 &);
+  };
+  const Workload workloads[] = {
+      {"fixed sizes", 1024 * MB, [](size_t, std::mt19937_64 &) { return std::vector<size_t>{64 * MB, 64 * MB, 64 << 10}; }},
+      {"sizes +-10%", 1024 * MB,
+       [](size_t, std::mt19937_64 &rng) {
+         std::uniform_int_distribution<size_t> jitter(58 * MB, 70 * MB);
+         return std::vector<size_t>{jitter(rng), jitter(rng), 64 << 10};
+       }},
+      {"growing sizes", 1024 * MB, [](size_t i, std::mt19937_64 &) { return std::vector<size_t>{MB + i * 64 * 1024}; }},
+      {"near capacity", 200 * MB, // cycles through three pairs, so the blocks cached from the previous pair must be trimmed
+       [](size_t i, std::mt19937_64 &) {
+         const size_t pairs[3][2] = {{96 * MB, 90 * MB}, {100 * MB, 80 * MB}, {60 * MB, 120 * MB}};
+         return std::vector<size_t>{pairs[i % 3][0], pairs[i % 3][1]};
+       }},
+  };
+
+  std::printf("%-16s %16s %16s %12s\n", "workload", "direct us/iter", "pool us/iter", "pool hits");
+  for (auto &w : workloads) {
+    deviceCapacity = w.capacity;
+    auto sizes = [&](size_t i) { return w.sizes(i, rng); };
+    auto direct = churn(
+        iterations, [&](void **ptr, size_t size) { return stubMalloc(ptr, size); }, [&](void *ptr, size_t) { stubFree(ptr); }, sizes);
+    DevicePool pool(api, 512 * MB);
+    auto pooled = churn(
+        iterations, [&](void **ptr, size_t size) { return pool.allocate(ptr, size); },
+        [&](void *ptr, size_t size) { pool.release(ptr, size); }, sizes);
+    pool.trim(0);
+    std::printf("%-16s %16.1f %16.1f %11.1f%%\n", w.name, direct.usPerIteration, pooled.usPerIteration, pooled.hitRate * 100);
+  }
+}
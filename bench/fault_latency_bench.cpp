@@ -0,0 +1,115 @@
+// Measures the host fault round trip of each fault backend, linked against the fault engine alone with host buffers standing in for device
+// memory, and the fault throughput when several threads fault on distinct allocations at once.
+// Each backend runs in its own process as the backend is chosen once at initialisation, see UTPX_FAULT_BACKEND.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "intercept_memory.h"
+
+using namespace utpx;
+
+static std::map<void *, std::vector<char>> devices; // keyed by host allocation, only modified while no faults are in flight
+
+void fault::handleUserspaceFault(void *, void *allocAddr, size_t offset, size_t length, void *dst) {
+  std::memcpy(dst, devices.at(allocAddr).data() + offset, length);
+}
+
+template <typename F> static double nsPerOp(size_t ops, F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  return double(elapsed) / double(ops);
+}
+
+static volatile char *allocate(size_t size) {
+  auto host = static_cast<char *>(aligned_alloc(fault::hostPageSize(), size + fault::hostPageSize()));
+  devices[host].assign(size, 1);
+  fault::registerPage(host, size);
+  return host;
+}
+
+static void release(volatile char *host) {
+  fault::unregisterPage(const_cast<char *>(host));
+  devices.erase(const_cast<char *>(host));
+  std::free(const_cast<char *>(host));
+}
+
+static void run(const char *backend) {
+  constexpr size_t pages = 4096;
+  fault::initialiseUserspacePagefaultHandling();
+  const size_t pageSize = fault::hostPageSize();
+  const size_t size = pages * pageSize;
+  auto host = allocate(size);
+
+  size_t sum = 0;
+  // every chunk is one page, so each access below takes exactly one fault
+  auto readMiss = nsPerOp(pages, [&]() {
+    for (size_t p = 0; p < pages; ++p)
+      sum += host[p * pageSize];
+  });
+  auto writeUpgrade = nsPerOp(pages, [&]() {
+    for (size_t p = 0; p < pages; ++p)
+      host[p * pageSize] = 2;
+  });
+  fault::releaseToDevice(const_cast<char *>(host), [](size_t, size_t) {});
+  auto writeMiss = nsPerOp(pages, [&]() {
+    for (size_t p = 0; p < pages; ++p)
+      host[p * pageSize] = 3;
+  });
+  if (sum != pages) {
+    std::fprintf(stderr, "%s: read back %zu, expected %zu\n", backend, sum, pages);
+    std::exit(EXIT_FAILURE);
+  }
+  std::printf("%12s %11.0f ns %11.0f ns %11.0f ns", backend, readMiss, writeUpgrade, writeMiss);
+  release(host);
+
+  // read misses from 1, 2, 4 and 8 threads at once, each on its own allocation
+  for (size_t threads = 1; threads <= 8; threads *= 2) {
+    std::vector<volatile char *> hosts(threads);
+    for (auto &h : hosts)
+      h = allocate(size);
+    std::vector<std::thread> workers;
+    auto nsPerFault = nsPerOp(threads * pages, [&]() {
+      for (size_t t = 0; t < threads; ++t)
+        workers.emplace_back([&, t]() {
+          for (size_t p = 0; p < pages; ++p)
+            (void)hosts[t][p * pageSize];
+        });
+      for (auto &w : workers)
+        w.join();
+    });
+    std::printf(" %8.2f", 1000.0 / nsPerFault);
+    for (auto h : hosts)
+      release(h);
+  }
+  std::printf("\n");
+  std::fflush(stdout);
+  fault::terminateUserspacePagefaultHandling();
+}
+
+int main() {
+  setenv("UTPX_CHUNK_SIZE", "4K", 1);
+  std::printf("%12s %14s %14s %14s %8s %8s %8s %8s\n", "backend", "read miss", "write upgrade", "write miss", "1T f/us", "2T f/us",
+              "4T f/us", "8T f/us");
+  std::fflush(stdout);
+  for (auto backend : {"SIGNAL", "USERFAULTFD"}) {
+    auto pid = fork();
+    if (pid == 0) {
+      setenv("UTPX_FAULT_BACKEND", backend, 1);
+      run(backend);
+      std::exit(EXIT_SUCCESS);
+    }
+    int status{};
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+      std::printf("%12s %14s\n", backend, "unavailable");
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+// Compares readHSACodeObject with the ELFIO and nlohmann::json based parseHSACodeObjectDOM on synthetic code objects of 10 to 10,000
+// kernels, and checks that both return the same metadata. The code objects are minimal ELF files holding only the AMDGPU metadata note,
+// with the keys a real gfx9 code object has for each kernel so that the reader has as much to skip as it would in practice.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <elf.h>
+#include <string>
+#include <vector>
+
+#include "hsaco.h"
+#include "json.hpp"
+
+using namespace utpx;
+
+static std::vector<uint8_t> metadata(size_t kernels) {
+  auto arg = [](const char *name, size_t offset, size_t size, const char *kind) {
+    return nlohmann::json{{".name", name}, {".offset", offset}, {".size", size}, {".value_kind", kind}};
+  };
+  nlohmann::json list = nlohmann::json::array();
+  for (size_t i = 0; i < kernels; ++i) {
+    auto name = "_Z" + std::to_string(std::to_string(i).size() + 7) + "kernel_" + std::to_string(i) + "PfPKfi";
+    auto out = arg("out", 0, 8, "global_buffer"), in = arg("in", 8, 8, "global_buffer");
+    out[".address_space"] = in[".address_space"] = "global";
+    out[".actual_access"] = "write_only";
+    in[".access"] = "read_only";
+    in[".is_const"] = true;
+    nlohmann::json args = {out, in, arg("n", 16, 4, "by_value")};
+    const char *hidden[] = {"hidden_global_offset_x", "hidden_global_offset_y", "hidden_global_offset_z", "hidden_none",
+                            "hidden_none",            "hidden_none",            "hidden_multigrid_sync_arg"};
+    for (size_t j = 0; j < std::size(hidden); ++j)
+      args.push_back({{".offset", 24 + j * 8}, {".size", 8}, {".value_kind", hidden[j]}});
+    list.push_back({{".args", args},
+                    {".group_segment_fixed_size", 0},
+                    {".kernarg_segment_align", 8},
+                    {".kernarg_segment_size", 24 + std::size(hidden) * 8 + i % 3 * 8},
+                    {".language", "OpenCL C"},
+                    {".language_version", {2, 0}},
+                    {".max_flat_workgroup_size", 1024},
+                    {".name", name},
+                    {".private_segment_fixed_size", i % 7 * 16},
+                    {".sgpr_count", 16 + i % 80},
+                    {".sgpr_spill_count", 0},
+                    {".symbol", name + ".kd"},
+                    {".vgpr_count", 4 + i % 200},
+                    {".vgpr_spill_count", 0},
+                    {".wavefront_size", 64}});
+  }
+  return nlohmann::json::to_msgpack({{"amdhsa.kernels", list}, {"amdhsa.target", "amdgcn-amd-amdhsa--gfx906"}, {"amdhsa.version", {1, 1}}});
+}
+
+// An ELF file with a null section, .note holding one NT_AMDGPU_METADATA note, and .shstrtab.
+static std::string codeObject(size_t kernels) {
+  auto desc = metadata(kernels);
+  auto align4 = [](size_t n) { return (n + 3) & ~size_t(3); };
+  std::string note(sizeof(Elf64_Nhdr) + 8 + align4(desc.size()), '\0');
+  Elf64_Nhdr nhdr{.n_namesz = 7, .n_descsz = Elf64_Word(desc.size()), .n_type = 32 /* NT_AMDGPU_METADATA */};
+  std::memcpy(note.data(), &nhdr, sizeof(nhdr));
+  std::memcpy(note.data() + sizeof(nhdr), "AMDGPU", 7);
+  std::memcpy(note.data() + sizeof(nhdr) + 8, desc.data(), desc.size());
+  const char names[] = "\0.note\0.shstrtab";
+
+  Elf64_Ehdr header{};
+  std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+  header.e_ident[EI_CLASS] = ELFCLASS64;
+  header.e_ident[EI_DATA] = ELFDATA2LSB;
+  header.e_ident[EI_VERSION] = EV_CURRENT;
+  header.e_type = ET_DYN;
+  header.e_machine = EM_AMDGPU;
+  header.e_version = EV_CURRENT;
+  header.e_ehsize = sizeof(Elf64_Ehdr);
+  header.e_shentsize = sizeof(Elf64_Shdr);
+  header.e_shnum = 3;
+  header.e_shstrndx = 2;
+  size_t noteOffset = sizeof(header), namesOffset = noteOffset + note.size();
+  header.e_shoff = (namesOffset + sizeof(names) + 7) & ~size_t(7);
+
+  Elf64_Shdr sections[3]{};
+  sections[1] = {.sh_name = 1, .sh_type = SHT_NOTE, .sh_offset = noteOffset, .sh_size = note.size(), .sh_addralign = 4};
+  sections[2] = {.sh_name = 7, .sh_type = SHT_STRTAB, .sh_offset = namesOffset, .sh_size = sizeof(names), .sh_addralign = 1};
+  std::string elf(header.e_shoff + sizeof(sections), '\0');
+  std::memcpy(elf.data(), &header, sizeof(header));
+  std::memcpy(elf.data() + noteOffset, note.data(), note.size());
+  std::memcpy(elf.data() + namesOffset, names, sizeof(names));
+  std::memcpy(elf.data() + header.e_shoff, sections, sizeof(sections));
+  return elf;
+}
+
+static bool same(const HSACOMeta &a, const HSACOMeta &b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].name != b[i].name || a[i].demangledName != b[i].demangledName || a[i].kernargSize != b[i].kernargSize ||
+        a[i].kernargAlign != b[i].kernargAlign || a[i].args.size() != b[i].args.size())
+      return false;
+    for (size_t j = 0; j < a[i].args.size(); ++j) {
+      auto &x = a[i].args[j], &y = b[i].args[j];
+      if (x.offset != y.offset || x.size != y.size || x.kind != y.kind || x.access != y.access) return false;
+    }
+  }
+  return true;
+}
+
+// Repeats parse for at least 200ms (and at least 3 times), returns the mean time in microseconds.
+template <typename F> static double time(F parse) {
+  using clock = std::chrono::steady_clock;
+  size_t reps = 0;
+  auto start = clock::now();
+  for (; reps < 3 || clock::now() - start < std::chrono::milliseconds(200); ++reps)
+    if (!parse()) std::exit(EXIT_FAILURE);
+  return double(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count()) / double(reps) / 1000.0;
+}
+
+int main() {
+  std::printf("%8s %10s %12s %12s %8s %6s\n", "kernels", "bytes", "DOM us", "reader us", "speedup", "match");
+  bool matched = true;
+  for (size_t kernels : {10, 100, 1000, 10000}) {
+    auto elf = codeObject(kernels);
+    auto dom = parseHSACodeObjectDOM(elf.data(), elf.size());
+    auto read = readHSACodeObject(elf.data(), elf.size());
+    bool match = dom && read && dom->size() == kernels && same(*dom, *read);
+    matched &= match;
+    auto domTime = time([&]() { return parseHSACodeObjectDOM(elf.data(), elf.size()).has_value(); });
+    auto readTime = time([&]() { return readHSACodeObject(elf.data(), elf.size()).has_value(); });
+    std::printf("%8zu %10zu %12.1f %12.1f %7.1fx %6s\n", kernels, elf.size(), domTime, readTime, domTime / readTime, match ? "yes" : "NO");
+  }
+  return matched ? EXIT_SUCCESS : EXIT_FAILURE;
+}
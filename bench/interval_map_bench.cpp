@@ -0,0 +1,121 @@
+// Measures containment lookups against the allocation index at various heap sizes.
+// The linear scan over an unordered_map is what utpx did before IntervalMap and is kept here as the baseline.
+// Also measures publishing a registry snapshot, a copy of the index with one allocation added and one removed, for IntervalMap against
+// ChunkedIntervalMap, which the registry uses so that this doesn't grow with the number of allocations.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "interval_map.h"
+
+using namespace utpx;
+
+template <typename F> static double nsPerOp(size_t ops, F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  return double(elapsed) / double(ops);
+}
+
+int main() {
+  constexpr size_t pageSize = 4096;
+  std::mt19937_64 rng(42);
+  std::printf("%10s %14s %14s %14s %14s %14s %14s %14s %14s\n", "allocs", "index hit", "index miss", "chunked hit", "chunked miss",
+              "linear hit", "linear miss", "flat publish", "chunk publish");
+  for (size_t n : {10, 1000, 100000}) {
+    IntervalMap<size_t> index;
+    ChunkedIntervalMap<size_t> chunked;
+    std::unordered_map<uintptr_t, size_t> linear;
+    std::uniform_int_distribution<size_t> pages(1, 64);
+    uintptr_t next = 0x7f0000000000;
+    for (size_t i = 0; i < n; ++i) {
+      auto size = pages(rng) * pageSize;
+      index.emplace(next, size, i);
+      chunked.emplace(next, size, i);
+      linear.emplace(next, size);
+      next += size + pageSize; // leave a gap so that misses inside the tracked span exist
+    }
+
+    std::vector<uintptr_t> hits(1 << 16), misses(1 << 16);
+    std::vector<uintptr_t> bases;
+    for (auto &e : index)
+      bases.push_back(e.base);
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+    for (auto &p : hits)
+      p = bases[pick(rng)] + pageSize / 2;
+    for (size_t i = 0; i < misses.size(); ++i) // half are gaps between allocations, half are small integers that look like struct fields
+      misses[i] = i % 2 ? bases[pick(rng)] - pageSize / 2 : rng() % 1024;
+
+    auto lookupIndex = [&](const std::vector<uintptr_t> &xs, size_t ops) {
+      size_t found = 0;
+      return std::pair{nsPerOp(ops,
+                               [&]() {
+                                 for (size_t i = 0; i < ops; ++i)
+                                   found += index.findContaining(xs[i % xs.size()]) != index.end();
+                               }),
+                       found};
+    };
+    auto lookupChunked = [&](const std::vector<uintptr_t> &xs, size_t ops) {
+      size_t found = 0;
+      return std::pair{nsPerOp(ops,
+                               [&]() {
+                                 for (size_t i = 0; i < ops; ++i)
+                                   found += chunked.findContaining(xs[i % xs.size()]) != chunked.end();
+                               }),
+                       found};
+    };
+    // every publish copies the current snapshot, frees one allocation and adds one past the end, like a hipFree and hipMallocManaged pair
+    auto publish = [&](auto &map, size_t ops) {
+      auto snapshot = map;
+      uintptr_t end = next;
+      return nsPerOp(ops, [&]() {
+        for (size_t i = 0; i < ops; ++i) {
+          auto copy = snapshot;
+          copy.erase(copy.find(bases[i % bases.size()]));
+          copy.emplace(end, pageSize, i);
+          snapshot = std::move(copy);
+          bases[i % bases.size()] = end;
+          end += 2 * pageSize;
+        }
+      });
+    };
+    auto lookupLinear = [&](const std::vector<uintptr_t> &xs, size_t ops) {
+      size_t found = 0;
+      return std::pair{nsPerOp(ops,
+                               [&]() {
+                                 for (size_t i = 0; i < ops; ++i) {
+                                   auto p = xs[i % xs.size()];
+                                   found += std::find_if(linear.begin(), linear.end(), [&](auto &kv) {
+                                              return p >= kv.first && p < kv.first + kv.second;
+                                            }) != linear.end();
+                                 }
+                               }),
+                       found};
+    };
+
+    size_t indexOps = 1 << 22, linearOps = std::max<size_t>(256, (size_t(1) << 26) / n);
+    auto [indexHit, indexHitFound] = lookupIndex(hits, indexOps);
+    auto [indexMiss, indexMissFound] = lookupIndex(misses, indexOps);
+    auto [chunkedHit, chunkedHitFound] = lookupChunked(hits, indexOps);
+    auto [chunkedMiss, chunkedMissFound] = lookupChunked(misses, indexOps);
+    auto [linearHit, linearHitFound] = lookupLinear(hits, linearOps);
+    auto [linearMiss, linearMissFound] = lookupLinear(misses, linearOps);
+    if (indexHitFound != indexOps || indexMissFound != 0 || chunkedHitFound != indexOps || chunkedMissFound != 0 ||
+        linearHitFound != linearOps || linearMissFound != 0) {
+      std::fprintf(stderr, "lookup mismatch at n=%zu\n", n);
+      return EXIT_FAILURE;
+    }
+    size_t publishOps = std::max<size_t>(64, (size_t(1) << 24) / n);
+    auto flatBases = bases;
+    auto flatPublish = publish(index, publishOps);
+    bases = flatBases; // the chunked map still holds the original allocations
+    auto chunkedPublish = publish(chunked, publishOps);
+    std::printf("%10zu %11.1f ns %11.1f ns %11.1f ns %11.1f ns %11.1f ns %11.1f ns %11.1f ns %11.1f ns\n", n, indexHit, indexMiss,
+                chunkedHit, chunkedMiss, linearHit, linearMiss, flatPublish, chunkedPublish);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+// Measures how many kernel launches per second UTPX intercepts when 1 to 64 host threads submit at once, against the stub runtime in
+// stub_hip.cpp. Every thread launches the same kernel on two allocations of its own and a lambda capture pointing at one shared by all
+// threads, the common shape of StdPar code. The second run adds a thread that keeps allocating and freeing, which changes the allocation
+// registry under the launching threads.
+// Usage: launch_rate_bench [milliseconds per measurement, default 250]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "hipew.h"
+#include "hsaco.h"
+#include "intercept_kernel.h"
+
+extern "C" hipError_t hipMallocManaged(void **ptr, size_t size, unsigned int flags);
+extern "C" hipError_t hipFree(void *ptr);
+
+using namespace utpx;
+
+struct Capture {
+  size_t n;
+  double *shared;
+  double scale;
+  int flags[4];
+  char padding[8];
+};
+
+static void *allocate(size_t size) {
+  void *ptr{};
+  if (hipMallocManaged(&ptr, size, 0) != hipSuccess) {
+    std::fprintf(stderr, "hipMallocManaged(%zu) failed\n", size);
+    std::exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+// Returns launches per second over all threads.
+static double launchRate(const HSACOKernelMeta &meta, double *shared, size_t threads, bool churn, std::chrono::milliseconds duration) {
+  std::atomic_bool start{}, stop{};
+  std::atomic_size_t launches{};
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&]() {
+      auto a = allocate(1 << 20), b = allocate(1 << 20);
+      Capture capture{.n = 1 << 17, .shared = shared, .scale = 2.0, .flags = {1, 2, 3, 4}, .padding = {}};
+      void *args[] = {&a, &b, &capture};
+      while (!start)
+        std::this_thread::yield();
+      size_t count = 0;
+      for (; !stop.load(std::memory_order_relaxed); ++count) {
+        kernel::interceptKernelLaunch(&meta, meta, args, dim3{1024, 1, 1}, dim3{256, 1, 1}, nullptr);
+        kernel::launchSubmitted(nullptr);
+      }
+      launches += count;
+      hipFree(a);
+      hipFree(b);
+    });
+  }
+  std::thread churner;
+  if (churn)
+    churner = std::thread([&]() {
+      while (!stop) {
+        auto ptr = allocate(64 << 10);
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        hipFree(ptr);
+      }
+    });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20)); // let every thread allocate before the clock starts
+  auto begin = std::chrono::steady_clock::now();
+  start = true;
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  auto elapsed = std::chrono::steady_clock::now() - begin;
+  for (auto &worker : workers)
+    worker.join();
+  if (churner.joinable()) churner.join();
+  return double(launches) / std::chrono::duration<double>(elapsed).count();
+}
+
+int main(int argc, char **argv) {
+  std::chrono::milliseconds duration(argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 250);
+  HSACOKernelMeta meta;
+  meta.name = "_Z6kernelPdS_6Capture";
+  meta.kernargSize = 16 + sizeof(Capture);
+  meta.kernargAlign = 8;
+  meta.args = {{.offset = 0, .size = 8, .kind = HSACOKernelMeta::Arg::Kind::GlobalBuffer},
+               {.offset = 8, .size = 8, .kind = HSACOKernelMeta::Arg::Kind::GlobalBuffer},
+               {.offset = 16, .size = sizeof(Capture), .kind = HSACOKernelMeta::Arg::Kind::ByValue}};
+  auto shared = static_cast<double *>(allocate(8 << 20));
+
+  std::printf("%8s %16s %16s %16s\n", "threads", "launches/s", "per thread", "with churn");
+  for (size_t threads : {1, 2, 4, 8, 16, 32, 64}) {
+    auto rate = launchRate(meta, shared, threads, false, duration);
+    auto churned = launchRate(meta, shared, threads, true, duration);
+    std::printf("%8zu %16.0f %16.0f %16.0f\n", threads, rate, rate / double(threads), churned);
+  }
+  hipFree(shared);
+}
@@ -0,0 +1,153 @@
+// Compares resolving the pointers in by-value kernel arguments the way interceptKernelLaunch did before, an allocation lookup for every
+// window, with scanPointerCandidates followed by lookups of the surviving windows only. Arguments are StdPar-like lambda captures from 16
+// bytes to 4K: pointers into tracked allocations mixed with sizes, indices, floats and padding. Both must find the same pointers, and the
+// vectorised scan must return the same candidates as the scalar one on random data.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "interval_map.h"
+#include "pointer_scan.h"
+
+using namespace utpx;
+
+using Found = std::vector<std::pair<size_t, uintptr_t>>; // argument offset, allocation base
+
+// The loop interceptKernelLaunch ran before, see forEachCandidate in utpx.cpp.
+static void resolveEveryWindow(IntervalMap<int> &allocations, const char *data, size_t size, size_t stride, Found &found) {
+  found.clear();
+  for (size_t offset = 0; offset + sizeof(uintptr_t) <= size; offset += stride) {
+    uintptr_t value;
+    std::memcpy(&value, data + offset, sizeof(uintptr_t));
+    if (auto it = allocations.findContaining(value); it != allocations.end()) {
+      found.emplace_back(offset, it->base);
+      offset += sizeof(uintptr_t) - stride;
+    }
+  }
+}
+
+static void resolveCandidates(IntervalMap<int> &allocations, const char *data, size_t size, size_t stride, std::vector<size_t> &candidates,
+                              Found &found) {
+  found.clear();
+  scanPointerCandidates(data, size, stride, allocations.lowerBound(), allocations.upperBound(), candidates);
+  size_t next = 0;
+  for (auto offset : candidates) {
+    if (offset < next) continue;
+    uintptr_t value;
+    std::memcpy(&value, data + offset, sizeof(uintptr_t));
+    if (auto it = allocations.findContaining(value); it != allocations.end()) {
+      found.emplace_back(offset, it->base);
+      next = offset + sizeof(uintptr_t);
+    }
+  }
+}
+
+// A capture of size bytes: every slot is a pointer into an allocation, a pointer just past the tracked range, a size, an int pair, a float
+// pair or zeros. Packed captures start with a 4 byte int so that their 8 byte members are misaligned.
+static std::vector<char> capture(std::mt19937_64 &rng, const std::vector<std::pair<uintptr_t, size_t>> &ranges, size_t size, bool packed) {
+  std::vector<char> data(size);
+  for (size_t offset = packed ? 4 : 0; offset + 8 <= size; offset += 8) {
+    uint64_t value{};
+    switch (rng() % 6) {
+      case 0:
+      case 1: {
+        auto &[base, length] = ranges[rng() % ranges.size()];
+        value = base + rng() % length;
+        break;
+      }
+      case 2: value = ranges.back().first + ranges.back().second + rng() % (1 << 20); break;
+      case 3: value = rng() % (1 << 24); break;
+      case 4: value = (rng() % 1024) | (rng() % 1024) << 32; break;
+      case 5: {
+        float pair[2] = {float(rng() % 1000) / 7.f, 1.f};
+        std::memcpy(&value, pair, sizeof(value));
+        break;
+      }
+    }
+    std::memcpy(data.data() + offset, &value, sizeof(value));
+  }
+  return data;
+}
+
+static bool checkRandom(std::mt19937_64 &rng) {
+  std::vector<size_t> scalar, vector;
+  for (size_t size = 0; size <= 300; ++size) {
+    std::vector<char> data(size);
+    for (int round = 0; round < 50; ++round) {
+      // values cluster around a few bases so that the bounds catch some of them, including lo and hi - 1 exactly
+      uintptr_t lo = 0x7f0000000000 + (rng() % 4) * 0x1000, hi = lo + (rng() % 3 == 0 ? 0 : rng() % 0x10000);
+      for (size_t offset = 0; offset < size; offset += 8) {
+        uint64_t value = rng() % 2 ? lo + rng() % 0x12000 - 0x1000 : rng();
+        if (rng() % 8 == 0) value = rng() % 2 ? lo : hi - 1;
+        std::memcpy(data.data() + offset, &value, std::min<size_t>(8, size - offset));
+      }
+      for (size_t stride : {1, 2, 4, 8}) {
+        scanPointerCandidatesScalar(data.data(), size, stride, lo, hi, scalar);
+        scanPointerCandidates(data.data(), size, stride, lo, hi, vector);
+        if (scalar != vector) {
+          std::fprintf(stderr, "candidates differ: size=%zu stride=%zu\n", size, stride);
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+template <typename F> static double nanosPerCall(size_t calls, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < calls; ++i)
+    f(i);
+  return double(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()) / double(calls);
+}
+
+int main() {
+  std::mt19937_64 rng(42);
+  if (!checkRandom(rng)) return EXIT_FAILURE;
+
+  // a few hundred allocations of 4K to 1M, laid out like the host arena would
+  IntervalMap<int> allocations;
+  std::vector<std::pair<uintptr_t, size_t>> ranges;
+  uintptr_t next = 0x7f1200000000;
+  for (int i = 0; i < 256; ++i) {
+    size_t size = size_t(4096) << (rng() % 9);
+    allocations.emplace(next, size, i);
+    ranges.emplace_back(next, size);
+    next += size + 4096 * (rng() % 4);
+  }
+
+  std::printf("%8s %7s %14s %14s %8s %6s\n", "bytes", "packed", "every ns", "scan ns", "speedup", "match");
+  bool matched = true;
+  std::vector<size_t> candidates;
+  Found expected, actual;
+  for (size_t size : {16, 24, 48, 64, 128, 256, 512, 1024, 4096}) {
+    for (bool packed : {false, true}) {
+      size_t stride = packed ? 1 : 2;
+      std::vector<std::vector<char>> captures;
+      for (int i = 0; i < 64; ++i)
+        captures.push_back(capture(rng, ranges, size, packed));
+      bool match = true;
+      for (auto &c : captures) {
+        resolveEveryWindow(allocations, c.data(), size, stride, expected);
+        resolveCandidates(allocations, c.data(), size, stride, candidates, actual);
+        match &= expected == actual;
+      }
+      matched &= match;
+      size_t calls = std::max<size_t>(1000, (size_t(64) << 20) / size);
+      auto every = nanosPerCall(calls, [&](size_t i) {
+        auto &c = captures[i % captures.size()];
+        resolveEveryWindow(allocations, c.data(), size, stride, expected);
+      });
+      auto scan = nanosPerCall(calls, [&](size_t i) {
+        auto &c = captures[i % captures.size()];
+        resolveCandidates(allocations, c.data(), size, stride, candidates, actual);
+      });
+      std::printf("%8zu %7s %14.1f %14.1f %7.1fx %6s\n", size, packed ? "yes" : "no", every, scan, every / scan, match ? "yes" : "NO");
+    }
+  }
+  return matched ? EXIT_SUCCESS : EXIT_FAILURE;
+}
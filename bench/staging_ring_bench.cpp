@@ -0,0 +1,81 @@
+// Measures the bandwidth of copies between pageable host memory and the device, either handed to hipMemcpy directly, which stages them
+// inside the runtime, or through StagingRing in a few configurations. This needs a GPU: HIP is loaded at runtime, like the library does.
+// Usage: staging_ring_bench [largest transfer in bytes, default 4G]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "hipew.h"
+#include "staging_ring.h"
+#include "utpx.h"
+
+using namespace utpx;
+
+// Repeats f until at least 1G (and at least twice) has been moved, returns GB/s.
+template <typename F> static double bandwidth(size_t size, F f) {
+  size_t reps = std::max<size_t>(2, (size_t(1) << 30) / size);
+  f(); // warm up, the first transfer also maps the staging buffers
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < reps; ++i)
+    f();
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  return double(size * reps) / double(elapsed);
+}
+
+static void check(hipError_t result, const char *what) {
+  if (result == hipSuccess) return;
+  std::fprintf(stderr, "%s failed with %d\n", what, result);
+  std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const size_t largest = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : size_t(4) << 30;
+  auto hipMalloc = dlSymbol<_hipMalloc>("hipMalloc", HipLibrarySO);
+  auto hipFree = dlSymbol<_hipFree>("hipFree", HipLibrarySO);
+  auto hipMemcpy = dlSymbol<_hipMemcpy>("hipMemcpy", HipLibrarySO);
+  const StagingRing::Api api{
+      .hostMalloc = dlSymbol<_hipHostMalloc>("hipHostMalloc", HipLibrarySO),
+      .memcpy = hipMemcpy,
+      .memcpyAsync = dlSymbol<_hipMemcpyAsync>("hipMemcpyAsync", HipLibrarySO),
+      .eventCreate = dlSymbol<_hipEventCreateWithFlags>("hipEventCreateWithFlags", HipLibrarySO),
+      .eventRecord = dlSymbol<_hipEventRecord>("hipEventRecord", HipLibrarySO),
+      .eventSynchronize = dlSymbol<_hipEventSynchronize>("hipEventSynchronize", HipLibrarySO),
+  };
+
+  struct Config {
+    const char *name;
+    size_t count, chunkSize;
+  };
+  const Config configs[] = {{"2x1M", 2, 1 << 20}, {"4x4M", 4, 4 << 20}, {"8x8M", 8, 8 << 20}};
+  std::vector<std::unique_ptr<StagingRing>> rings;
+  for (auto &config : configs)
+    rings.emplace_back(new StagingRing(api, config.count, config.chunkSize));
+
+  void *device{};
+  check(hipMalloc(&device, largest), "hipMalloc");
+  std::vector<char> host(largest, 1); // pageable, and touched so that page faults aren't measured
+
+  std::printf("%-6s %10s %12s", "dir", "size", "direct GB/s");
+  for (auto &config : configs)
+    std::printf(" %12s", config.name);
+  std::printf("\n");
+  for (size_t size = 4 << 10; size <= largest; size *= 4) {
+    auto h2d = bandwidth(size, [&]() { check(hipMemcpy(device, host.data(), size, hipMemcpyHostToDevice), "hipMemcpy"); });
+    std::printf("%-6s %10zu %12.2f", "H2D", size, h2d);
+    for (auto &ring : rings)
+      std::printf(" %12.2f", bandwidth(size, [&]() {
+                    check(ring->upload(device, host.data(), size, nullptr), "upload");
+                    check(ring->drain(), "drain");
+                  }));
+    auto d2h = bandwidth(size, [&]() { check(hipMemcpy(host.data(), device, size, hipMemcpyDeviceToHost), "hipMemcpy"); });
+    std::printf("\n%-6s %10zu %12.2f", "D2H", size, d2h);
+    for (auto &ring : rings)
+      std::printf(" %12.2f", bandwidth(size, [&]() { check(ring->download(host.data(), device, size, nullptr), "download"); }));
+    std::printf("\n");
+  }
+  check(hipFree(device), "hipFree");
+}
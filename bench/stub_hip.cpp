@@ -0,0 +1,99 @@
+// A stand-in for the HIP runtime that libutpx resolves its originals from, for benchmarks that drive the whole library without a GPU.
+// Device memory is host memory and every copy completes immediately, so a benchmark measures UTPX's own overhead. Each thread has a
+// current device like in HIP, and the devices share the host memory, so peer copies are plain copies too.
+
+#include <cstdlib>
+#include <cstring>
+
+#include "hipew.h"
+
+extern "C" {
+
+hipError_t hipMalloc(void **ptr, size_t size) {
+  *ptr = std::aligned_alloc(4096, (size + 4095) / 4096 * 4096);
+  return *ptr ? hipSuccess : hipErrorOutOfMemory;
+}
+hipError_t hipMallocManaged(void **ptr, size_t size, unsigned) { return hipMalloc(ptr, size); }
+hipError_t hipHostMalloc(void **ptr, size_t size, unsigned) { return hipMalloc(ptr, size); }
+hipError_t hipFree(void *ptr) {
+  std::free(ptr);
+  return hipSuccess;
+}
+hipError_t hipHostRegister(void *, size_t, unsigned) { return hipSuccess; }
+hipError_t hipHostUnregister(void *) { return hipSuccess; }
+hipError_t hipHostGetDevicePointer(void **device, void *host, unsigned) {
+  *device = host;
+  return hipSuccess;
+}
+
+hipError_t hipMemcpy(void *dst, const void *src, size_t size, hipMemcpyKind) {
+  std::memcpy(dst, src, size);
+  return hipSuccess;
+}
+hipError_t hipMemcpyAsync(void *dst, const void *src, size_t size, hipMemcpyKind kind, hipStream_t) { return hipMemcpy(dst, src, size, kind); }
+hipError_t hipMemcpy2D(void *dst, size_t dpitch, const void *src, size_t spitch, size_t width, size_t height, hipMemcpyKind) {
+  for (size_t row = 0; row < height; ++row)
+    std::memcpy(static_cast<char *>(dst) + row * dpitch, static_cast<const char *>(src) + row * spitch, width);
+  return hipSuccess;
+}
+hipError_t hipMemcpy2DAsync(void *dst, size_t dpitch, const void *src, size_t spitch, size_t width, size_t height, hipMemcpyKind kind,
+                            hipStream_t) {
+  return hipMemcpy2D(dst, dpitch, src, spitch, width, height, kind);
+}
+hipError_t hipMemcpyPeerAsync(void *dst, int, const void *src, int, size_t size, hipStream_t) {
+  std::memcpy(dst, src, size);
+  return hipSuccess;
+}
+hipError_t hipMemset(void *ptr, int value, size_t size) {
+  std::memset(ptr, value, size);
+  return hipSuccess;
+}
+hipError_t hipMemsetAsync(void *ptr, int value, size_t size, hipStream_t) {
+  std::memset(ptr, value, size);
+  return hipSuccess;
+}
+hipError_t hipMemsetD16Async(void *ptr, unsigned short value, size_t count, hipStream_t) {
+  for (size_t i = 0; i < count; ++i)
+    std::memcpy(static_cast<char *>(ptr) + i * sizeof(value), &value, sizeof(value));
+  return hipSuccess;
+}
+hipError_t hipMemsetD32Async(void *ptr, int value, size_t count, hipStream_t) {
+  for (size_t i = 0; i < count; ++i)
+    std::memcpy(static_cast<char *>(ptr) + i * sizeof(value), &value, sizeof(value));
+  return hipSuccess;
+}
+hipError_t hipMemset2DAsync(void *ptr, size_t pitch, int value, size_t width, size_t height, hipStream_t) {
+  for (size_t row = 0; row < height; ++row)
+    std::memset(static_cast<char *>(ptr) + row * pitch, value, width);
+  return hipSuccess;
+}
+
+static thread_local int currentDevice = 0;
+hipError_t hipGetDevice(int *device) {
+  *device = currentDevice;
+  return hipSuccess;
+}
+hipError_t hipSetDevice(int device) {
+  currentDevice = device;
+  return hipSuccess;
+}
+hipError_t hipDeviceSynchronize() { return hipSuccess; }
+hipError_t hipMemAdvise(const void *, size_t, hipMemoryAdvise, int) { return hipSuccess; }
+hipError_t hipMemPrefetchAsync(const void *, size_t, int, hipStream_t) { return hipSuccess; }
+hipError_t hipPointerGetAttributes(hipPointerAttribute_t *attributes, const void *) {
+  std::memset(attributes, 0, sizeof(*attributes));
+  return hipSuccess;
+}
+
+hipError_t hipEventCreateWithFlags(hipEvent_t *event, unsigned) {
+  *event = reinterpret_cast<hipEvent_t>(std::malloc(1));
+  return hipSuccess;
+}
+hipError_t hipEventRecord(hipEvent_t, hipStream_t) { return hipSuccess; }
+hipError_t hipEventSynchronize(hipEvent_t) { return hipSuccess; }
+hipError_t hipStreamWaitEvent(hipStream_t, hipEvent_t, unsigned) { return hipSuccess; }
+hipError_t hipStreamAddCallback(hipStream_t stream, hipStreamCallback_t callback, void *userData, unsigned) {
+  callback(stream, hipSuccess, userData);
+  return hipSuccess;
+}
+}
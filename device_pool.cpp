@@ -0,0 +1,105 @@
+#include <algorithm>
+
+#include "device_pool.h"
+#include "stats.h"
+#include "utpx.h"
+
+namespace utpx {
+
+static stats::Counter poolHits("pool.hits");
+static stats::Counter poolMisses("pool.misses");
+static stats::Counter poolTrimmedBytes("pool.trimmed.bytes");
+
+DevicePool::DevicePool(const Api &api, size_t retainLimit) : api(api), retainLimit(retainLimit) {}
+
+size_t DevicePool::sizeClass(size_t size) {
+  // Four classes per power of two, so at most a quarter is wasted, but never rounded by more than 2M so that large allocations stay close
+  // to their size. Sizes that are reallocated every iteration are almost always identical anyway.
+  constexpr size_t minStep = 4 << 10, maxStep = 2 << 20;
+  if (size <= minStep) return minStep;
+  size_t power = size_t(1) << (63 - __builtin_clzll(size - 1));
+  size_t step = std::clamp(power / 4, minStep, maxStep);
+  return (size + step - 1) / step * step;
+}
+
+hipError_t DevicePool::allocate(void **ptr, size_t size) {
+  auto classSize = sizeClass(size);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (auto bin = bins.find(classSize); bin != bins.end() && !bin->second.empty()) {
+      auto block = *bin->second.back();
+      blocks.erase(bin->second.back());
+      bin->second.pop_back();
+      retainedBytes -= block.size;
+      if (auto result = api.eventSynchronize(block.released); result != hipSuccess)
+        log("[POOL] hipEventSynchronize failed with %d, reusing %p anyway", result, block.ptr);
+      spareEvents.push_back(block.released);
+      ++poolHits;
+      log("[POOL] Reusing %p for %zu bytes (class %zu)", block.ptr, size, classSize);
+      *ptr = block.ptr;
+      return hipSuccess;
+    }
+  }
+  ++poolMisses;
+  auto result = api.malloc(ptr, classSize);
+  if (result == hipErrorOutOfMemory) {
+    log("[POOL] hipMalloc(%zu) ran out of memory, releasing %zu cached bytes and retrying", classSize, retained());
+    trim(0);
+    result = api.malloc(ptr, classSize);
+  }
+  return result;
+}
+
+void DevicePool::release(void *ptr, size_t size, hipEvent_t lastUse) {
+  if (!ptr) return;
+  auto classSize = sizeClass(size);
+  std::lock_guard<std::mutex> guard(lock);
+  hipEvent_t released{};
+  if (classSize <= retainLimit) {
+    if (!spareEvents.empty()) {
+      released = spareEvents.back();
+      spareEvents.pop_back();
+    } else if (api.eventCreate(&released, hipEventDisableTiming) != hipSuccess)
+      released = nullptr;
+  }
+  // orders the release after lastUse without blocking, a later allocate then waits for both
+  if (released && lastUse && api.streamWaitEvent(nullptr, lastUse, 0) != hipSuccess) {
+    spareEvents.push_back(released);
+    released = nullptr;
+  }
+  if (!released || api.eventRecord(released, nullptr) != hipSuccess) {
+    if (released) spareEvents.push_back(released);
+    if (auto result = api.free(ptr); result != hipSuccess) log("[POOL] hipFree(%p) failed with %d", ptr, result);
+    return;
+  }
+  trimLocked(retainLimit - classSize);
+  blocks.push_back(Block{.ptr = ptr, .size = classSize, .released = released});
+  bins[classSize].push_back(std::prev(blocks.end()));
+  retainedBytes += classSize;
+}
+
+void DevicePool::trim(size_t bytes) {
+  std::lock_guard<std::mutex> guard(lock);
+  trimLocked(bytes);
+}
+
+void DevicePool::trimLocked(size_t bytes) {
+  while (retainedBytes > bytes) {
+    auto &block = blocks.front();
+    auto &bin = bins[block.size];
+    bin.erase(std::find(bin.begin(), bin.end(), blocks.begin()));
+    // hipFree waits for the device itself
+    if (auto result = api.free(block.ptr); result != hipSuccess) log("[POOL] hipFree(%p) failed with %d", block.ptr, result);
+    spareEvents.push_back(block.released);
+    retainedBytes -= block.size;
+    poolTrimmedBytes.add(block.size);
+    blocks.pop_front();
+  }
+}
+
+size_t DevicePool::retained() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return retainedBytes;
+}
+
+} // namespace utpx
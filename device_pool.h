@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "hipew.h"
+
+namespace utpx {
+
+// Caches released device allocations in size classes so that later allocations of a similar size reuse them instead of going through
+// hipMalloc and hipFree, both of which are slow and may synchronise the device. See UTPX_POOL_LIMIT.
+// A released block is only handed out again once the work queued on the null stream before its release has completed, and the work
+// recorded by the event it was released with, which is what hipFree would have waited for.
+class DevicePool {
+public:
+  // The HIP functions the pool allocates with, so that it can run against a stub.
+  struct Api {
+    _hipMalloc malloc;
+    _hipFree free;
+    _hipEventCreateWithFlags eventCreate;
+    _hipEventRecord eventRecord;
+    _hipEventSynchronize eventSynchronize;
+    _hipStreamWaitEvent streamWaitEvent;
+  };
+
+  DevicePool(const Api &api, size_t retainLimit);
+
+  // Rounds size up to its size class, blocks are always allocated at that size so that any cached block of a class fits any request of it.
+  [[nodiscard]] static size_t sizeClass(size_t size);
+  // Allocates at least size bytes, reusing a cached block of the same class if there is one. If hipMalloc runs out of memory, every cached
+  // block is freed and the allocation retried once.
+  [[nodiscard]] hipError_t allocate(void **ptr, size_t size);
+  // Takes back a block from allocate, it is cached unless that would retain more than retainLimit bytes. lastUse, if set, is recorded after
+  // the last work that uses the block on streams that don't synchronise with the null stream.
+  void release(void *ptr, size_t size, hipEvent_t lastUse = nullptr);
+  // Frees cached blocks, least recently released first, until at most bytes are retained.
+  void trim(size_t bytes);
+  [[nodiscard]] size_t retained() const;
+
+private:
+  struct Block {
+    void *ptr;
+    size_t size; // the size class
+    hipEvent_t released;
+  };
+
+  void trimLocked(size_t bytes);
+
+  Api api;
+  size_t retainLimit;
+  mutable std::mutex lock;
+  std::list<Block> blocks;                                                  // cached, least recently released first
+  std::unordered_map<size_t, std::vector<std::list<Block>::iterator>> bins; // cached blocks by size class, most recently released last
+  std::vector<hipEvent_t> spareEvents;
+  size_t retainedBytes{};
+};
+
+} // namespace utpx
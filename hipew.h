@@ -55,11 +55,21 @@ typedef enum hipMemcpyKind {
 } hipMemcpyKind;
 
 typedef struct ihipStream_t *hipStream_t;
+typedef struct ihipEvent_t *hipEvent_t;
 typedef struct ihipModuleSymbol_t *hipFunction_t;
 typedef struct ihipModule_t *hipModule_t;
 
 typedef hipError_t (*_hipMalloc)(void **, size_t);
 typedef hipError_t (*_hipMemset)(void *, int, size_t);
+typedef hipError_t (*_hipMemsetAsync)(void *, int, size_t, hipStream_t);
+typedef hipError_t (*_hipMemsetD8)(void *, unsigned char, size_t);
+typedef hipError_t (*_hipMemsetD16)(void *, unsigned short, size_t);
+typedef hipError_t (*_hipMemsetD32)(void *, int, size_t);
+typedef hipError_t (*_hipMemsetD8Async)(void *, unsigned char, size_t, hipStream_t);
+typedef hipError_t (*_hipMemsetD16Async)(void *, unsigned short, size_t, hipStream_t);
+typedef hipError_t (*_hipMemsetD32Async)(void *, int, size_t, hipStream_t);
+typedef hipError_t (*_hipMemset2D)(void *, size_t, int, size_t, size_t);
+typedef hipError_t (*_hipMemset2DAsync)(void *, size_t, int, size_t, size_t, hipStream_t);
 typedef hipError_t (*_hipMemcpy)(void *, const void *, size_t, hipMemcpyKind);
 typedef hipError_t (*_hipFree)(void *);
 typedef hipError_t (*_hipMallocManaged)(void **, size_t, unsigned int);
@@ -68,6 +78,29 @@ typedef hipError_t (*_hipPointerGetAttributes)(hipPointerAttribute_t *, const vo
 typedef hipError_t (*_hipGetDevice)(int *device);
 typedef hipError_t (*_hipMemAdvise)(const void *, size_t, hipMemoryAdvise, int);
 typedef hipError_t (*_hipMemPrefetchAsync)(const void *, size_t, int, hipStream_t);
+typedef hipError_t (*_hipMemcpyAsync)(void *, const void *, size_t, hipMemcpyKind, hipStream_t);
+typedef hipError_t (*_hipMemcpyPeerAsync)(void *, int, const void *, int, size_t, hipStream_t);
+typedef hipError_t (*_hipMemcpy2D)(void *, size_t, const void *, size_t, size_t, size_t, hipMemcpyKind);
+typedef hipError_t (*_hipMemcpy2DAsync)(void *, size_t, const void *, size_t, size_t, size_t, hipMemcpyKind, hipStream_t);
+typedef void *hipDeviceptr_t;
+typedef hipError_t (*_hipMemcpyHtoD)(hipDeviceptr_t, void *, size_t);
+typedef hipError_t (*_hipMemcpyDtoH)(void *, hipDeviceptr_t, size_t);
+typedef hipError_t (*_hipMemcpyDtoD)(hipDeviceptr_t, hipDeviceptr_t, size_t);
+typedef hipError_t (*_hipMemcpyHtoDAsync)(hipDeviceptr_t, void *, size_t, hipStream_t);
+typedef hipError_t (*_hipMemcpyDtoHAsync)(void *, hipDeviceptr_t, size_t, hipStream_t);
+typedef hipError_t (*_hipMemcpyDtoDAsync)(hipDeviceptr_t, hipDeviceptr_t, size_t, hipStream_t);
+typedef hipError_t (*_hipHostMalloc)(void **, size_t, unsigned int);
+typedef hipError_t (*_hipHostRegister)(void *, size_t, unsigned int);
+typedef hipError_t (*_hipHostUnregister)(void *);
+#define hipHostRegisterPortable 0x1
+#define hipHostRegisterMapped 0x2
+typedef hipError_t (*_hipHostGetDevicePointer)(void **, void *, unsigned int);
+
+#define hipEventDisableTiming 0x2
+typedef hipError_t (*_hipEventCreateWithFlags)(hipEvent_t *, unsigned);
+typedef hipError_t (*_hipEventRecord)(hipEvent_t, hipStream_t);
+typedef hipError_t (*_hipEventSynchronize)(hipEvent_t);
+typedef hipError_t (*_hipStreamWaitEvent)(hipStream_t, hipEvent_t, unsigned int);
 
 typedef void *(*___hipstdpar_realloc)(void *, std::size_t);
 typedef void (*___hipstdpar_free)(void *);
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include "host_arena.h"
+#include "stats.h"
+#include "utpx.h"
+
+namespace utpx {
+
+static stats::Counter mappedBytes("host.arena.mapped.bytes");
+static stats::Counter pinnedBytes("host.arena.pinned.bytes");
+
+static uintptr_t alignUp(uintptr_t value, size_t alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+HostArena::HostArena(size_t pageSize, size_t regionSize, bool pin, bool hugePages, const Api &api)
+    : pageSize(pageSize), regionSize(alignUp(regionSize, hugePageSize)), pin(pin), hugePages(hugePages), api(api) {}
+
+HostArena::Mapping *HostArena::map(size_t size) {
+  // over-map by a huge page and trim, so that the mapping starts on a huge page boundary
+  auto raw = mmap(nullptr, size + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (raw == MAP_FAILED) {
+    log("[ARENA] mmap(%zu) failed: %s", size + hugePageSize, strerror(errno));
+    return nullptr;
+  }
+  auto rawBase = reinterpret_cast<uintptr_t>(raw);
+  auto base = alignUp(rawBase, hugePageSize);
+  if (base != rawBase) munmap(raw, base - rawBase);
+  munmap(reinterpret_cast<void *>(base + size), rawBase + hugePageSize - base);
+  if (hugePages && madvise(reinterpret_cast<void *>(base), size, MADV_HUGEPAGE) != 0)
+    log("[ARENA] madvise(%p, %zu, MADV_HUGEPAGE) failed: %s", reinterpret_cast<void *>(base), size, strerror(errno));
+  mappedBytes.add(size);
+
+  bool pinned = false;
+  if (pin) {
+    if (auto result = api.hostRegister(reinterpret_cast<void *>(base), size, 0); result == hipSuccess) {
+      pinned = true;
+      pinnedBytes.add(size);
+    } else
+      log("[ARENA] hipHostRegister(%p, %zu) failed with %d, mapping stays pageable", reinterpret_cast<void *>(base), size, result);
+  }
+  log("[ARENA] Mapped %p+%zu, pinned=%d", reinterpret_cast<void *>(base), size, pinned);
+  auto &mapping = mappings.emplace_back(new Mapping{.base = base, .size = size, .pinned = pinned, .dedicated = false, .free = {}});
+  mapping->free.emplace(base, size);
+  return mapping.get();
+}
+
+void HostArena::unmap(Mapping *mapping) {
+  log("[ARENA] Unmapping %p+%zu", reinterpret_cast<void *>(mapping->base), mapping->size);
+  if (mapping->pinned) api.hostUnregister(reinterpret_cast<void *>(mapping->base));
+  munmap(reinterpret_cast<void *>(mapping->base), mapping->size);
+  mappings.erase(std::find_if(mappings.begin(), mappings.end(), [&](auto &m) { return m.get() == mapping; }));
+}
+
+std::optional<uintptr_t> HostArena::carve(Mapping &mapping, size_t size, size_t alignment) {
+  for (auto it = mapping.free.begin(); it != mapping.free.end(); ++it) {
+    auto [extentBase, extentSize] = *it;
+    auto start = alignUp(extentBase, alignment);
+    if (start + size > extentBase + extentSize) continue;
+    mapping.free.erase(it);
+    if (start != extentBase) mapping.free.emplace(extentBase, start - extentBase);
+    if (start + size != extentBase + extentSize) mapping.free.emplace(start + size, extentBase + extentSize - (start + size));
+    return start;
+  }
+  return {};
+}
+
+void *HostArena::allocate(size_t size) {
+  auto rounded = alignUp(size, pageSize);
+  auto alignment = hugePages && rounded >= hugePageSize ? hugePageSize : pageSize;
+  std::lock_guard<std::mutex> guard(lock);
+  std::optional<uintptr_t> base;
+  Mapping *owner{};
+  if (rounded > regionSize / 4) { // large allocations get a mapping of their own, so that freeing them returns the memory
+    if (!(owner = map(rounded))) return nullptr;
+    owner->dedicated = true;
+    base = carve(*owner, rounded, alignment);
+  } else {
+    for (auto &mapping : mappings) {
+      if (mapping->dedicated || !(base = carve(*mapping, rounded, alignment))) continue;
+      owner = mapping.get();
+      break;
+    }
+    if (!owner) {
+      if (!(owner = map(regionSize))) return nullptr;
+      base = carve(*owner, rounded, alignment);
+    }
+  }
+  allocations.emplace(*base, Allocation{.size = rounded, .mapping = owner});
+  return reinterpret_cast<void *>(*base);
+}
+
+void HostArena::release(void *ptr) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = allocations.find(reinterpret_cast<uintptr_t>(ptr));
+  if (it == allocations.end()) fatal("[ARENA] Releasing %p which is not from the arena", ptr);
+  auto [size, mapping] = it->second;
+  allocations.erase(it);
+  if (mapping->dedicated) {
+    unmap(mapping);
+    return;
+  }
+  // put the extent back, merging it with the free extents on either side
+  auto base = reinterpret_cast<uintptr_t>(ptr);
+  auto next = mapping->free.lower_bound(base);
+  if (next != mapping->free.end() && next->first == base + size) {
+    size += next->second;
+    next = mapping->free.erase(next);
+  }
+  if (next != mapping->free.begin()) {
+    if (auto prev = std::prev(next); prev->first + prev->second == base) {
+      prev->second += size;
+      return;
+    }
+  }
+  mapping->free.emplace_hint(next, base, size);
+}
+
+bool HostArena::pinned(const void *ptr) const {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = allocations.find(reinterpret_cast<uintptr_t>(ptr));
+  return it != allocations.end() && it->second.mapping->pinned;
+}
+
+} // namespace utpx
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "hipew.h"
+
+namespace utpx {
+
+// Host memory for mirrored allocations, carved out of large anonymous mappings at page boundaries so that no two allocations share a page
+// and protecting one never affects another. With hugePages, mappings are advised for transparent huge pages, and allocations of a huge page
+// or more start on a huge page boundary so that protecting them whole doesn't split the huge pages they cover. That only holds while the
+// fault backend keeps protected pages mapped, the userfaultfd backend drops them, which splits any huge page they are part of.
+// Mappings are optionally registered with HIP as pinned memory, so that copies to and from them skip the runtime's own staging.
+// See UTPX_HOST_REGION_SIZE and UTPX_HOST_PIN.
+class HostArena {
+public:
+  // The HIP functions used for pinning, so that the arena can run without HIP.
+  struct Api {
+    _hipHostRegister hostRegister;
+    _hipHostUnregister hostUnregister;
+  };
+
+  HostArena(size_t pageSize, size_t regionSize, bool pin, bool hugePages, const Api &api);
+
+  // Returns page-aligned memory for at least size bytes, rounded up to whole pages, or nullptr if no memory could be mapped.
+  [[nodiscard]] void *allocate(size_t size);
+  // Takes back memory from allocate.
+  void release(void *ptr);
+  // Whether ptr, which must come from allocate, is registered with HIP as pinned memory.
+  [[nodiscard]] bool pinned(const void *ptr) const;
+
+private:
+  static constexpr size_t hugePageSize = 2 << 20;
+
+  struct Mapping {
+    uintptr_t base;
+    size_t size;
+    bool pinned;
+    bool dedicated;                   // holds a single large allocation and is unmapped with it
+    std::map<uintptr_t, size_t> free; // extents by base, coalesced
+  };
+  struct Allocation {
+    size_t size;
+    Mapping *mapping;
+  };
+
+  [[nodiscard]] Mapping *map(size_t size);
+  void unmap(Mapping *mapping);
+  [[nodiscard]] static std::optional<uintptr_t> carve(Mapping &mapping, size_t size, size_t alignment);
+
+  size_t pageSize;
+  size_t regionSize;
+  bool pin;
+  bool hugePages;
+  Api api;
+  mutable std::mutex lock;
+  std::vector<std::unique_ptr<Mapping>> mappings;
+  std::unordered_map<uintptr_t, Allocation> allocations;
+};
+
+} // namespace utpx
@@ -67,7 +67,39 @@ bool utpx::HSACOKernelMeta::packed(size_t index) const {
     return args[index].offset + args[index].size < args[index + 1].offset;
 }
 
+[[maybe_unused]] static const char *kindName(utpx::HSACOKernelMeta::Arg::Kind kind) {
+  switch (kind) {
+    case utpx::HSACOKernelMeta::Arg::Kind::ByValue: return "ByValue";
+    case utpx::HSACOKernelMeta::Arg::Kind::GlobalBuffer: return "GlobalBuffer";
+    case utpx::HSACOKernelMeta::Arg::Kind::Hidden: return "Hidden";
+    case utpx::HSACOKernelMeta::Arg::Kind::Unknown: return "Unknown";
+    default: return "Undefined";
+  }
+}
+
 std::optional<utpx::HSACOMeta> utpx::parseHSACodeObject(const char *data, size_t length) {
+  auto meta = readHSACodeObject(data, length);
+  if (!meta) {
+    log("[HSACO] Cannot read ELF file at %p+%ld directly, parsing with ELFIO", data, length);
+    meta = parseHSACodeObjectDOM(data, length);
+  }
+  if (!meta) return {};
+  log("[HSACO] Found %zu kernels:", meta->size());
+  for (auto &kernel : *meta) {
+    log("[HSACO] \t%s", kernel.name.c_str());
+    log("[HSACO] \t - kernargSize:  %zu", kernel.kernargSize);
+    log("[HSACO] \t - kernargAlign: %zu", kernel.kernargAlign);
+    log("[HSACO] \t - args:" );
+    for (size_t k = 0; k < kernel.args.size(); ++k) {
+      auto &arg = kernel.args[k];
+      log("[HSACO] \t   - %ld+%ld packed=%d, kind=%s, access=%d", arg.size, arg.offset, kernel.packed(k), kindName(arg.kind),
+          int(arg.access));
+    }
+  }
+  return meta;
+}
+
+std::optional<utpx::HSACOMeta> utpx::parseHSACodeObjectDOM(const char *data, size_t length) {
   elfio reader;
   // ELFIO is streaming, so we make an istream out of some constant data
   imemstream stream(data, length);
@@ -76,16 +108,6 @@ std::optional<utpx::HSACOMeta> utpx::parseHSACodeObject(const char *data, size_t
     return {};
   }
 
-  const auto kindName = [](HSACOKernelMeta::Arg::Kind kind) {
-    switch (kind) {
-      case HSACOKernelMeta::Arg::Kind::ByValue: return "ByValue";
-      case HSACOKernelMeta::Arg::Kind::GlobalBuffer: return "GlobalBuffer";
-      case HSACOKernelMeta::Arg::Kind::Hidden: return "Hidden";
-      case HSACOKernelMeta::Arg::Kind::Unknown: return "Unknown";
-      default: return "Undefined";
-    }
-  };
-
   auto parseArgKind = [](const std::string &value) -> HSACOKernelMeta::Arg::Kind {
     if (value.rfind("hidden_", 0) == 0) return HSACOKernelMeta::Arg::Kind::Hidden;
     else if (value == "by_value")
@@ -96,6 +118,20 @@ std::optional<utpx::HSACOMeta> utpx::parseHSACodeObject(const char *data, size_t
       return HSACOKernelMeta::Arg::Kind::Unknown;
   };
 
+  auto parseArgAccess = [](const nlohmann::json &rawArg) -> HSACOKernelMeta::Arg::Access {
+    auto access = rawArg.find(".actual_access");
+    if (access == rawArg.end()) access = rawArg.find(".access");
+    if (access == rawArg.end() || !access->is_string()) return HSACOKernelMeta::Arg::Access::Unknown;
+    else if (*access == "read_only")
+      return HSACOKernelMeta::Arg::Access::ReadOnly;
+    else if (*access == "write_only")
+      return HSACOKernelMeta::Arg::Access::WriteOnly;
+    else if (*access == "read_write")
+      return HSACOKernelMeta::Arg::Access::ReadWrite;
+    else
+      return HSACOKernelMeta::Arg::Access::Unknown;
+  };
+
   for (const std::unique_ptr<ELFIO::section> &s : reader.sections) {
     if (s->get_type() != SHT_NOTE) continue;
     // We only care about the .note section where the first record has the AMDGPU name
@@ -104,35 +140,22 @@ std::optional<utpx::HSACOMeta> utpx::parseHSACodeObject(const char *data, size_t
     if (nhdr->n_type == NT_AMDGPU_METADATA && nhdr->name(sData) == "AMDGPU") {
       auto [descBegin, descEnd] = nhdr->desc(sData);
       auto kernels = nlohmann::json::from_msgpack(descBegin, descEnd).at("amdhsa.kernels");
-
-//      static int kernelI = 0;
-//      std::ofstream myfile;
-//      myfile.open(std::to_string(kernelI++) + ".json");
-//      myfile << kernels << "\n";
-//      myfile.close();
-
-      log("[HSACO] Found %zu kernels:", kernels.size());
       HSACOMeta meta(kernels.size());
       for (size_t i = 0; i < kernels.size(); ++i) {
-        auto rawArgs = kernels[i].at(".args");
+        const auto &rawArgs = kernels[i].at(".args");
         std::vector<HSACOKernelMeta::Arg> args(rawArgs.size());
         for (size_t j = 0; j < args.size(); ++j) {
-          auto rawArg = rawArgs.at(j);
-          args[j] = {.offset = rawArg.at(".offset"), .size = rawArg.at(".size"), .kind = parseArgKind(rawArg.at(".value_kind"))};
+          const auto &rawArg = rawArgs.at(j);
+          args[j] = {.offset = rawArg.at(".offset"),
+                     .size = rawArg.at(".size"),
+                     .kind = parseArgKind(rawArg.at(".value_kind")),
+                     .access = parseArgAccess(rawArg)};
         }
         meta[i].name = kernels[i].at(".name").get<std::string>();
         meta[i].demangledName = demangleCXXName(meta[i].name.c_str());
         meta[i].kernargSize = kernels[i].at(".kernarg_segment_size");
         meta[i].kernargAlign = kernels[i].at(".kernarg_segment_align");
-        meta[i].args = args;
-        log("[HSACO] \t%s", meta[i].name.c_str());
-        log("[HSACO] \t - kernargSize:  %zu", meta[i].kernargSize);
-        log("[HSACO] \t - kernargAlign: %zu", meta[i].kernargAlign);
-        log("[HSACO] \t - args:" );
-        for (size_t k = 0; k < meta[i].args.size(); ++k) {
-          auto &arg = meta[i].args[k];
-          log("[HSACO] \t   - %ld+%ld packed=%d, kind=%s", arg.size, arg.offset, meta[i].packed(k), kindName(arg.kind));
-        }
+        meta[i].args = std::move(args);
       }
       return meta;
     }
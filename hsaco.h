@@ -17,9 +17,14 @@ struct HSACOKernelMeta {
     enum class Kind : uint8_t {
       ByValue, GlobalBuffer, Hidden, Unknown
     };
+    // .actual_access where the compiler inferred it, otherwise the declared .access
+    enum class Access : uint8_t {
+      Unknown, ReadOnly, WriteOnly, ReadWrite
+    };
 
     size_t offset, size;
     Kind kind;
+    Access access = Access::Unknown;
   };
 
   std::string name;
@@ -30,7 +35,13 @@ struct HSACOKernelMeta {
 };
 using HSACOMeta = std::vector<HSACOKernelMeta>  ;
 
+// Reads the metadata with readHSACodeObject, falling back to parseHSACodeObjectDOM for code objects it can't read.
 std::optional<HSACOMeta> parseHSACodeObject(const char *data, size_t length);
+// Walks the ELF section headers and streams through the msgpack metadata note in place, without copying the code object or building a
+// DOM. Returns nothing if the code object is malformed, has no AMDGPU metadata, or uses an encoding the reader doesn't handle.
+std::optional<HSACOMeta> readHSACodeObject(const char *data, size_t length);
+// The ELFIO and nlohmann::json based parser, which readHSACodeObject must agree with.
+std::optional<HSACOMeta> parseHSACodeObjectDOM(const char *data, size_t length);
 std::string  demangleCXXName(const char *abiName) ;
 
 } // namespace utpx
\ No newline at end of file
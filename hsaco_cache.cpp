@@ -0,0 +1,207 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hsaco_cache.h"
+#include "stats.h"
+#include "utpx.h"
+
+namespace utpx {
+
+static stats::Counter cacheHits("hsaco.cache.hits");
+static stats::Counter cacheMisses("hsaco.cache.misses");
+
+// Cache file layout, all in native byte order as the cache is only read by the machine type that wrote it:
+//   CacheHeader
+//   CacheKernel[kernelCount]
+//   CacheArg[argCount]       args of every kernel, in kernel order
+//   char[stringBytes]        names, referred to by offset and length
+// The header repeats the code object's size and hash so that an entry is never used for another code object, even on a hash collision in
+// the file name.
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t kernelCount;
+  uint64_t codeObjectSize;
+  uint64_t codeObjectHash;
+  uint64_t argCount;
+  uint64_t stringBytes;
+};
+struct CacheKernel {
+  uint64_t nameOffset, nameLength;
+  uint64_t demangledNameOffset, demangledNameLength;
+  uint64_t kernargSize, kernargAlign;
+  uint64_t argCount;
+};
+struct CacheArg {
+  uint64_t offset, size;
+  uint32_t kind, access;
+};
+
+static constexpr char cacheMagic[8] = {'U', 'T', 'P', 'X', 'H', 'S', 'A', 'C'};
+static constexpr uint32_t cacheVersion = 2;
+
+uint64_t hashCodeObject(const char *data, size_t length) {
+  // MurmurHash64A, code objects are tens of megabytes at most so this is cheap next to parsing them
+  constexpr uint64_t m = 0xc6a4a7935bd1e995ULL;
+  constexpr int r = 47;
+  uint64_t h = 0x5554505848534143ULL ^ (length * m);
+  size_t words = length / 8;
+  for (size_t i = 0; i < words; ++i) {
+    uint64_t k;
+    std::memcpy(&k, data + i * 8, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  auto tail = reinterpret_cast<const unsigned char *>(data + words * 8);
+  switch (length & 7) {
+    case 7: h ^= uint64_t(tail[6]) << 48; [[fallthrough]];
+    case 6: h ^= uint64_t(tail[5]) << 40; [[fallthrough]];
+    case 5: h ^= uint64_t(tail[4]) << 32; [[fallthrough]];
+    case 4: h ^= uint64_t(tail[3]) << 24; [[fallthrough]];
+    case 3: h ^= uint64_t(tail[2]) << 16; [[fallthrough]];
+    case 2: h ^= uint64_t(tail[1]) << 8; [[fallthrough]];
+    case 1: h ^= uint64_t(tail[0]); h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+static const std::string &cacheDirectory() {
+  static const std::string directory = [] {
+    auto value = std::getenv("UTPX_HSACO_CACHE");
+    if (!value || !*value) return std::string();
+    if (mkdir(value, 0755) != 0 && errno != EEXIST) {
+      log("[HSACO] Cannot create cache directory %s: %s, caching disabled", value, strerror(errno));
+      return std::string();
+    }
+    return std::string(value);
+  }();
+  return directory;
+}
+
+static std::optional<HSACOMeta> decode(const char *file, size_t fileSize, size_t length, uint64_t hash) {
+  if (fileSize < sizeof(CacheHeader)) return {};
+  CacheHeader header;
+  std::memcpy(&header, file, sizeof(header));
+  if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion ||
+      header.codeObjectSize != length || header.codeObjectHash != hash)
+    return {};
+  if (header.argCount > fileSize / sizeof(CacheArg) || header.stringBytes > fileSize ||
+      sizeof(CacheHeader) + header.kernelCount * sizeof(CacheKernel) + header.argCount * sizeof(CacheArg) + header.stringBytes != fileSize)
+    return {};
+  auto kernels = reinterpret_cast<const CacheKernel *>(file + sizeof(CacheHeader));
+  auto args = reinterpret_cast<const CacheArg *>(kernels + header.kernelCount);
+  auto strings = reinterpret_cast<const char *>(args + header.argCount);
+  auto string = [&](uint64_t offset, uint64_t stringLength) -> std::optional<std::string> {
+    if (offset > header.stringBytes || stringLength > header.stringBytes - offset) return {};
+    return std::string(strings + offset, stringLength);
+  };
+
+  HSACOMeta meta(header.kernelCount);
+  uint64_t nextArg = 0;
+  for (size_t i = 0; i < meta.size(); ++i) {
+    const auto &kernel = kernels[i];
+    auto name = string(kernel.nameOffset, kernel.nameLength);
+    auto demangledName = string(kernel.demangledNameOffset, kernel.demangledNameLength);
+    if (!name || !demangledName || kernel.argCount > header.argCount - nextArg) return {};
+    meta[i].name = std::move(*name);
+    meta[i].demangledName = std::move(*demangledName);
+    meta[i].kernargSize = kernel.kernargSize;
+    meta[i].kernargAlign = kernel.kernargAlign;
+    meta[i].args.resize(kernel.argCount);
+    for (auto &arg : meta[i].args) {
+      const auto &cached = args[nextArg++];
+      if (cached.kind > uint32_t(HSACOKernelMeta::Arg::Kind::Unknown) || cached.access > uint32_t(HSACOKernelMeta::Arg::Access::ReadWrite))
+        return {};
+      arg = {.offset = cached.offset,
+             .size = cached.size,
+             .kind = HSACOKernelMeta::Arg::Kind(cached.kind),
+             .access = HSACOKernelMeta::Arg::Access(cached.access)};
+    }
+  }
+  return meta;
+}
+
+static std::optional<HSACOMeta> load(const std::string &path, size_t length, uint64_t hash) {
+  auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return {};
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return {};
+  }
+  auto file = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) return {};
+  auto meta = decode(static_cast<const char *>(file), st.st_size, length, hash);
+  munmap(file, st.st_size);
+  if (!meta) log("[HSACO] Ignoring invalid cache entry %s", path.c_str());
+  return meta;
+}
+
+static void store(const std::string &path, size_t length, uint64_t hash, const HSACOMeta &meta) {
+  CacheHeader header{};
+  std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+  header.version = cacheVersion;
+  header.kernelCount = uint32_t(meta.size());
+  header.codeObjectSize = length;
+  header.codeObjectHash = hash;
+  std::vector<CacheKernel> kernels;
+  std::vector<CacheArg> args;
+  std::string strings;
+  for (const auto &kernel : meta) {
+    kernels.push_back({.nameOffset = strings.size(),
+                       .nameLength = kernel.name.size(),
+                       .demangledNameOffset = strings.size() + kernel.name.size(),
+                       .demangledNameLength = kernel.demangledName.size(),
+                       .kernargSize = kernel.kernargSize,
+                       .kernargAlign = kernel.kernargAlign,
+                       .argCount = kernel.args.size()});
+    strings += kernel.name;
+    strings += kernel.demangledName;
+    for (const auto &arg : kernel.args)
+      args.push_back({.offset = arg.offset, .size = arg.size, .kind = uint32_t(arg.kind), .access = uint32_t(arg.access)});
+  }
+  header.argCount = args.size();
+  header.stringBytes = strings.size();
+
+  if (!writeFileAtomically(path, [&](std::FILE *file) {
+        auto write = [&](const void *data, size_t size) { return std::fwrite(data, 1, size, file) == size; };
+        return write(&header, sizeof(header)) && write(kernels.data(), kernels.size() * sizeof(CacheKernel)) &&
+               write(args.data(), args.size() * sizeof(CacheArg)) && write(strings.data(), strings.size());
+      }))
+    log("[HSACO] Cannot write cache entry %s: %s", path.c_str(), strerror(errno));
+}
+
+std::optional<HSACOMeta> parseHSACodeObjectCached(const char *data, size_t length) {
+  const auto &directory = cacheDirectory();
+  if (directory.empty()) return parseHSACodeObject(data, length);
+  auto hash = hashCodeObject(data, length);
+  char name[64];
+  std::snprintf(name, sizeof(name), "/%016lx-%zu.meta", hash, length);
+  auto path = directory + name;
+  if (auto meta = load(path, length, hash); meta) {
+    ++cacheHits;
+    log("[HSACO] Loaded %zu kernels for code object at %p+%zu from %s", meta->size(), data, length, path.c_str());
+    return meta;
+  }
+  ++cacheMisses;
+  auto meta = parseHSACodeObject(data, length);
+  if (meta) store(path, length, hash, *meta);
+  return meta;
+}
+
+} // namespace utpx
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "hsaco.h"
+
+namespace utpx {
+
+// Parsed kernel metadata is cached on disk in the directory named by UTPX_HSACO_CACHE, one file per code object keyed by a hash of its
+// contents, so that later runs skip the ELF and msgpack parsing (and demangling) of code objects they have seen before.
+// Entries are flat arrays that are read straight out of a read-only mapping of the file, see hsaco_cache.cpp for the layout.
+
+// Returns the metadata of the code object at data, from the cache if it has an entry for it, otherwise parsed with parseHSACodeObject and
+// stored for next time. Behaves exactly like parseHSACodeObject if UTPX_HSACO_CACHE is not set.
+std::optional<HSACOMeta> parseHSACodeObjectCached(const char *data, size_t length);
+
+// 64-bit content hash used as the cache key.
+[[nodiscard]] uint64_t hashCodeObject(const char *data, size_t length);
+
+} // namespace utpx
@@ -0,0 +1,265 @@
+#include <cstring>
+#include <elf.h>
+#include <string_view>
+
+#include "hsaco.h"
+#include "utpx.h"
+
+// Reads code objects without ELFIO or nlohmann::json: the section headers and notes are read where they are in the caller's buffer, and
+// the msgpack metadata is streamed through once, decoding only the keys we keep and skipping everything else in place.
+
+namespace utpx {
+
+// See llvm/include/llvm/BinaryFormat/ELF.h, AMDGPU vendor specific note (Code Object V3 and later)
+static constexpr Elf64_Word AMDGPUMetadataNote = 32;
+
+// Headers are copied out rather than cast in place, the buffer handed to us has no alignment guarantee.
+template <typename T> static bool readAt(const char *data, size_t length, uint64_t offset, T &out) {
+  if (offset > length || sizeof(T) > length - offset) return false;
+  std::memcpy(&out, data + offset, sizeof(T));
+  return true;
+}
+
+// A cursor over a msgpack buffer, see https://github.com/msgpack/msgpack/blob/master/spec.md.
+// Every read returns false on truncated input or a value of an unexpected type, which fails the whole parse.
+class MsgPackReader {
+public:
+  MsgPackReader(const char *begin, const char *end)
+      : pos(reinterpret_cast<const uint8_t *>(begin)), end(reinterpret_cast<const uint8_t *>(end)) {}
+
+  [[nodiscard]] bool map(uint64_t &size) { return container(0x80, 0xde, size); }
+  [[nodiscard]] bool array(uint64_t &size) { return container(0x90, 0xdc, size); }
+
+  [[nodiscard]] bool string(std::string_view &out) {
+    uint64_t size;
+    if (!remaining(1)) return false;
+    uint8_t type = *pos++;
+    if ((type & 0xe0) == 0xa0) size = type & 0x1f;
+    else if (type == 0xd9 || type == 0xda || type == 0xdb) {
+      if (!bigEndian(1 << (type - 0xd9), size)) return false;
+    } else
+      return false;
+    if (!remaining(size)) return false;
+    out = {reinterpret_cast<const char *>(pos), size_t(size)};
+    pos += size;
+    return true;
+  }
+
+  [[nodiscard]] bool unsignedInt(uint64_t &out) {
+    if (!remaining(1)) return false;
+    uint8_t type = *pos++;
+    if (type <= 0x7f) {
+      out = type;
+      return true;
+    } else if (type >= 0xcc && type <= 0xcf) // uint 8/16/32/64
+      return bigEndian(1 << (type - 0xcc), out);
+    else if (type >= 0xd0 && type <= 0xd3) { // int 8/16/32/64, accepted if not negative
+      size_t bytes = 1 << (type - 0xd0);
+      if (!bigEndian(bytes, out)) return false;
+      return bytes == 8 ? int64_t(out) >= 0 : (out >> (bytes * 8 - 1)) == 0;
+    } else
+      return false;
+  }
+
+  // Skips one value, including everything nested in it, without recursing.
+  [[nodiscard]] bool skip() {
+    for (uint64_t pending = 1; pending != 0; --pending) {
+      if (!remaining(1)) return false;
+      uint8_t type = *pos++;
+      uint64_t size = 0;
+      if (type <= 0x7f || type >= 0xe0 || type == 0xc0 || type == 0xc2 || type == 0xc3) continue; // fixint, nil, bool
+      else if ((type & 0xf0) == 0x80) pending += uint64_t(type & 0x0f) * 2;                        // fixmap
+      else if ((type & 0xf0) == 0x90) pending += type & 0x0f;                                      // fixarray
+      else if ((type & 0xe0) == 0xa0) size = type & 0x1f;                                          // fixstr
+      else if (type >= 0xcc && type <= 0xcf) size = 1 << (type - 0xcc);                           // uint
+      else if (type >= 0xd0 && type <= 0xd3) size = 1 << (type - 0xd0);                           // int
+      else if (type == 0xca) size = 4;                                                             // float32
+      else if (type == 0xcb) size = 8;                                                             // float64
+      else if (type >= 0xd4 && type <= 0xd8) size = 1 + (1 << (type - 0xd4));                     // fixext, type byte and data
+      else if (type == 0xd9 || type == 0xc4) {                                                     // str8, bin8
+        if (!bigEndian(1, size)) return false;
+      } else if (type == 0xda || type == 0xc5) {                                                   // str16, bin16
+        if (!bigEndian(2, size)) return false;
+      } else if (type == 0xdb || type == 0xc6) {                                                   // str32, bin32
+        if (!bigEndian(4, size)) return false;
+      } else if (type >= 0xc7 && type <= 0xc9) {                                                   // ext 8/16/32
+        if (!bigEndian(1 << (type - 0xc7), size)) return false;
+        size += 1;
+      } else if (type == 0xdc || type == 0xdd || type == 0xde || type == 0xdf) {                   // array/map 16/32
+        if (!bigEndian(type & 1 ? 4 : 2, size)) return false;
+        if (size > uint64_t(end - pos)) return false; // every element takes at least a byte
+        pending += type >= 0xde ? size * 2 : size;
+        size = 0;
+      } else
+        return false; // 0xc1 is never used
+      if (!remaining(size)) return false;
+      pos += size;
+    }
+    return true;
+  }
+
+private:
+  [[nodiscard]] bool remaining(uint64_t size) const { return size <= uint64_t(end - pos); }
+
+  [[nodiscard]] bool bigEndian(size_t bytes, uint64_t &out) {
+    if (!remaining(bytes)) return false;
+    out = 0;
+    for (size_t i = 0; i < bytes; ++i)
+      out = out << 8 | *pos++;
+    return true;
+  }
+
+  // fix is the fixmap/fixarray prefix, wide the 16 bit variant which is followed by the 32 bit one
+  [[nodiscard]] bool container(uint8_t fix, uint8_t wide, uint64_t &size) {
+    if (!remaining(1)) return false;
+    uint8_t type = *pos++;
+    if ((type & 0xf0) == fix) {
+      size = type & 0x0f;
+      return true;
+    } else if (type == wide || type == wide + 1)
+      return bigEndian(type == wide ? 2 : 4, size) && size <= uint64_t(end - pos);
+    else
+      return false;
+  }
+
+  const uint8_t *pos, *end;
+};
+
+static HSACOKernelMeta::Arg::Kind argKind(std::string_view value) {
+  if (value.rfind("hidden_", 0) == 0) return HSACOKernelMeta::Arg::Kind::Hidden;
+  else if (value == "by_value")
+    return HSACOKernelMeta::Arg::Kind::ByValue;
+  else if (value == "global_buffer")
+    return HSACOKernelMeta::Arg::Kind::GlobalBuffer;
+  else
+    return HSACOKernelMeta::Arg::Kind::Unknown;
+}
+
+static HSACOKernelMeta::Arg::Access argAccess(std::string_view value) {
+  if (value == "read_only") return HSACOKernelMeta::Arg::Access::ReadOnly;
+  else if (value == "write_only")
+    return HSACOKernelMeta::Arg::Access::WriteOnly;
+  else if (value == "read_write")
+    return HSACOKernelMeta::Arg::Access::ReadWrite;
+  else
+    return HSACOKernelMeta::Arg::Access::Unknown;
+}
+
+static bool readArg(MsgPackReader &reader, HSACOKernelMeta::Arg &arg) {
+  uint64_t keys;
+  if (!reader.map(keys)) return false;
+  bool hasOffset = false, hasSize = false, hasKind = false, hasActualAccess = false;
+  for (uint64_t i = 0; i < keys; ++i) {
+    std::string_view key, value;
+    if (!reader.string(key)) return false;
+    if (key == ".offset") {
+      if (!reader.unsignedInt(arg.offset)) return false;
+      hasOffset = true;
+    } else if (key == ".size") {
+      if (!reader.unsignedInt(arg.size)) return false;
+      hasSize = true;
+    } else if (key == ".value_kind") {
+      if (!reader.string(value)) return false;
+      arg.kind = argKind(value);
+      hasKind = true;
+    } else if (key == ".actual_access") {
+      if (!reader.string(value)) return false;
+      arg.access = argAccess(value);
+      hasActualAccess = true;
+    } else if (key == ".access") {
+      if (!reader.string(value)) return false;
+      if (!hasActualAccess) arg.access = argAccess(value);
+    } else if (!reader.skip())
+      return false;
+  }
+  return hasOffset && hasSize && hasKind;
+}
+
+static bool readKernel(MsgPackReader &reader, HSACOKernelMeta &kernel) {
+  uint64_t keys;
+  if (!reader.map(keys)) return false;
+  bool hasName = false, hasArgs = false, hasKernargSize = false, hasKernargAlign = false;
+  for (uint64_t i = 0; i < keys; ++i) {
+    std::string_view key;
+    if (!reader.string(key)) return false;
+    if (key == ".name") {
+      std::string_view name;
+      if (!reader.string(name)) return false;
+      kernel.name = name;
+      hasName = true;
+    } else if (key == ".kernarg_segment_size") {
+      if (!reader.unsignedInt(kernel.kernargSize)) return false;
+      hasKernargSize = true;
+    } else if (key == ".kernarg_segment_align") {
+      if (!reader.unsignedInt(kernel.kernargAlign)) return false;
+      hasKernargAlign = true;
+    } else if (key == ".args") {
+      uint64_t count;
+      if (!reader.array(count)) return false;
+      kernel.args.resize(count);
+      for (auto &arg : kernel.args)
+        if (!readArg(reader, arg)) return false;
+      hasArgs = true;
+    } else if (!reader.skip())
+      return false;
+  }
+  if (!hasName || !hasArgs || !hasKernargSize || !hasKernargAlign) return false;
+  kernel.demangledName = demangleCXXName(kernel.name.c_str());
+  return true;
+}
+
+static std::optional<HSACOMeta> readMetadata(const char *begin, const char *end) {
+  MsgPackReader reader(begin, end);
+  uint64_t keys;
+  if (!reader.map(keys)) return {};
+  for (uint64_t i = 0; i < keys; ++i) {
+    std::string_view key;
+    if (!reader.string(key)) return {};
+    if (key != "amdhsa.kernels") {
+      if (!reader.skip()) return {};
+      continue;
+    }
+    uint64_t count;
+    if (!reader.array(count)) return {};
+    HSACOMeta meta(count);
+    for (auto &kernel : meta)
+      if (!readKernel(reader, kernel)) return {};
+    return meta;
+  }
+  return {};
+}
+
+std::optional<HSACOMeta> readHSACodeObject(const char *data, size_t length) {
+  Elf64_Ehdr header;
+  if (!readAt(data, length, 0, header) || std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64 ||
+      header.e_ident[EI_DATA] != ELFDATA2LSB || header.e_shentsize != sizeof(Elf64_Shdr))
+    return {};
+  uint64_t sectionCount = header.e_shnum;
+  if (sectionCount == 0 && header.e_shoff != 0) { // extended numbering, the count is in the first section header
+    Elf64_Shdr first;
+    if (!readAt(data, length, header.e_shoff, first)) return {};
+    sectionCount = first.sh_size;
+  }
+  if (header.e_shoff > length || sectionCount > (length - header.e_shoff) / sizeof(Elf64_Shdr)) return {};
+
+  for (uint64_t i = 0; i < sectionCount; ++i) {
+    Elf64_Shdr section;
+    if (!readAt(data, length, header.e_shoff + i * sizeof(Elf64_Shdr), section)) return {};
+    if (section.sh_type != SHT_NOTE || section.sh_offset > length || section.sh_size > length - section.sh_offset) continue;
+    auto notes = data + section.sh_offset;
+    for (uint64_t offset = 0; offset < section.sh_size;) {
+      Elf64_Nhdr note;
+      if (!readAt(notes, section.sh_size, offset, note)) break;
+      uint64_t nameOffset = offset + sizeof(note);
+      uint64_t descOffset = nameOffset + ((uint64_t(note.n_namesz) + 3) & ~uint64_t(3));
+      uint64_t nextOffset = descOffset + ((uint64_t(note.n_descsz) + 3) & ~uint64_t(3));
+      if (descOffset > section.sh_size || note.n_descsz > section.sh_size - descOffset) break;
+      if (note.n_type == AMDGPUMetadataNote && std::string_view(notes + nameOffset, note.n_namesz) == std::string_view("AMDGPU", 7))
+        return readMetadata(notes + descOffset, notes + descOffset + note.n_descsz);
+      offset = nextOffset;
+    }
+  }
+  return {};
+}
+
+} // namespace utpx
@@ -1,3 +1,7 @@
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -6,29 +10,39 @@
 
 #include "hipew.h"
 #include "hsaco.h"
+#include "hsaco_cache.h"
 #include "hsaew.h"
 #include "intercept_kernel.h"
 #include "utpx.h"
 
 namespace utpx {
 
-static std::atomic_bool recordKernelMetadata;
-static std::unordered_map<const void *, HSACOKernelMeta> kernelNameToMetadata;
-static std::vector<HSACOKernelMeta> kernelMetadata;
+// Metadata is only ever appended, so pointers to it stay valid and launches can cache them per thread instead of taking registryLock.
+static std::atomic_int recordKernelMetadata; // number of registrations in progress
+static std::shared_mutex registryLock;
+static std::deque<HSACOKernelMeta> kernelMetadata;
+static std::unordered_map<std::string_view, const HSACOKernelMeta *> kernelsByName;    // first recorded kernel of each name
+static std::unordered_map<const void *, const HSACOKernelMeta *> kernelNameToMetadata; // by host function
+static std::unordered_map<hipFunction_t, const HSACOKernelMeta *> functionMetadata;    // by module function, filled on first launch
+// The entries this thread has launched with, so that repeated launches don't touch registryLock.
+static thread_local std::unordered_map<const void *, const HSACOKernelMeta *> launchHostFunctions;
+static thread_local std::unordered_map<hipFunction_t, const HSACOKernelMeta *> launchModuleFunctions;
 
 extern "C" [[maybe_unused]] hsa_status_t hsa_code_object_reader_create_from_memory( //
     const void *code_object,                                                        //
     size_t size,                                                                    //
     hsa_code_object_reader_t *code_object_reader) {
   // Here we have access to our ELF code object, we extract the .note section and record the metadata.
-  auto original = dlSymbol<_hsa_code_object_reader_create_from_memory>("hsa_code_object_reader_create_from_memory", HsaLibrarySO);
+  static auto original = dlSymbol<_hsa_code_object_reader_create_from_memory>("hsa_code_object_reader_create_from_memory", HsaLibrarySO);
   auto result = original(code_object, size, code_object_reader);
   if (recordKernelMetadata && result == HSA_STATUS_SUCCESS) {
-    if (auto coMeta = parseHSACodeObject(reinterpret_cast<const char *>(code_object), size); coMeta) {
-      kernelMetadata.insert(kernelMetadata.end(), coMeta->begin(), coMeta->end());
-      for (const auto &kernelMeta : *coMeta) {
+    if (auto coMeta = parseHSACodeObjectCached(reinterpret_cast<const char *>(code_object), size); coMeta) {
+      std::unique_lock<std::shared_mutex> write(registryLock);
+      for (auto &kernelMeta : *coMeta) {
+        auto &recorded = kernelMetadata.emplace_back(std::move(kernelMeta));
+        kernelsByName.emplace(recorded.name, &recorded);
         log("[KERNEL] Recorded: name=%s argCount=%ld, argSize=%ld, argAlignment=%ld", //
-            kernelMeta.name.c_str(), kernelMeta.args.size(), kernelMeta.kernargSize, kernelMeta.kernargAlign);
+            recorded.name.c_str(), recorded.args.size(), recorded.kernargSize, recorded.kernargAlign);
       }
     }
   }
@@ -54,19 +68,17 @@ extern "C" [[maybe_unused]] void __hipRegisterFunction( // NOLINT(*-reserved-ide
   // Without this, HIP defers to the first kernel launch, which makes modifications to the kernel args very difficult.
   auto originalDeferredLoading = getenv(HIP_ENABLE_DEFERRED_LOADING);
   setenv(HIP_ENABLE_DEFERRED_LOADING, "0", /* override */ 1);
-  auto original = dlSymbol<___hipRegisterFunction>("__hipRegisterFunction", HipLibrarySO);
-  recordKernelMetadata = true;
+  static auto original = dlSymbol<___hipRegisterFunction>("__hipRegisterFunction", HipLibrarySO);
+  ++recordKernelMetadata;
   original(modules, hostFunction, deviceFunction, deviceName, threadLimit, tid, bid, blockDim, gridDim, wSize);
   // __hipRegisterFunction internally invokes a series of HSA calls to set up the code object, and what we need is the
   // HSA ELF image which is available when hsa_code_object_reader_create_from_memory is called, so we intercept that function.
-  recordKernelMetadata = false;
+  --recordKernelMetadata;
   if (!originalDeferredLoading) unsetenv(HIP_ENABLE_DEFERRED_LOADING);
   else
     setenv(HIP_ENABLE_DEFERRED_LOADING, originalDeferredLoading, /* override */ 1);
-  if (auto it = std::find_if(kernelMetadata.begin(), kernelMetadata.end(), [&](auto &meta) { return meta.name == deviceFunction; });
-      it != kernelMetadata.end()) {
-    kernelNameToMetadata.emplace(hostFunction, *it);
-  }
+  std::unique_lock<std::shared_mutex> write(registryLock);
+  if (auto it = kernelsByName.find(deviceFunction); it != kernelsByName.end()) kernelNameToMetadata.emplace(hostFunction, it->second);
 }
 
 extern "C" [[maybe_unused]] hipError_t hipModuleLoadDataEx( //
@@ -75,16 +87,43 @@ extern "C" [[maybe_unused]] hipError_t hipModuleLoadDataEx( //
     unsigned int numOptions,                                //
     hipJitOption *options,                                  //
     void **optionValues) {
-  auto original = dlSymbol<_hipModuleLoadDataEx>("hipModuleLoadDataEx", HipLibrarySO);
+  static auto original = dlSymbol<_hipModuleLoadDataEx>("hipModuleLoadDataEx", HipLibrarySO);
   log("[KERNEL] Intercepting hipModuleLoadDataEx(module=%p, image=%p, numOpts=%d, jitOpts=%p, options%p)", //
       module, image, numOptions, options, optionValues);
 
-  recordKernelMetadata = true;
+  ++recordKernelMetadata;
   auto result = original(module, image, numOptions, options, optionValues);
-  recordKernelMetadata = false;
+  --recordKernelMetadata;
   return result;
 }
 
+static const HSACOKernelMeta *findMetadata(const void *hostFunction) {
+  if (auto it = launchHostFunctions.find(hostFunction); it != launchHostFunctions.end()) return it->second;
+  std::shared_lock<std::shared_mutex> read(registryLock);
+  auto it = kernelNameToMetadata.find(hostFunction);
+  if (it == kernelNameToMetadata.end()) return nullptr;
+  return launchHostFunctions[hostFunction] = it->second;
+}
+
+static const HSACOKernelMeta *findMetadata(hipFunction_t f) {
+  // Module functions are freed with their module and another kernel may get the same handle later, so cached entries are checked against
+  // the kernel's name, which is still far cheaper than searching by name.
+  const auto &name = reinterpret_cast<amdDeviceFunc *>(f)->name_;
+  if (auto it = launchModuleFunctions.find(f); it != launchModuleFunctions.end() && it->second->name == name) return it->second;
+  const HSACOKernelMeta *meta{};
+  {
+    std::shared_lock<std::shared_mutex> read(registryLock);
+    if (auto it = functionMetadata.find(f); it != functionMetadata.end() && it->second->name == name) meta = it->second;
+  }
+  if (!meta) {
+    std::unique_lock<std::shared_mutex> write(registryLock);
+    auto it = kernelsByName.find(name);
+    if (it == kernelsByName.end()) return nullptr;
+    meta = functionMetadata[f] = it->second;
+  }
+  return launchModuleFunctions[f] = meta;
+}
+
 static thread_local bool inhibitInterception = {};
 
 void kernel::suspendInterception() { inhibitInterception = true; }
@@ -97,18 +136,22 @@ extern "C" [[maybe_unused]] hipError_t hipLaunchKernel( //
     void **args,                                        //
     size_t sharedMemBytes,                              //
     hipStream_t stream) {
-  auto original = dlSymbol<_hipLaunchKernel>("hipLaunchKernel", HipLibrarySO);
+  static auto original = dlSymbol<_hipLaunchKernel>("hipLaunchKernel", HipLibrarySO);
+  bool intercepted = false;
   if (!inhibitInterception) {
     log("[KERNEL] Intercepting hipLaunchKernel(f=%p, grid=(%d,%d,%d), block=(%d,%d,%d), args=%p, sharedMemBytes=%ld, stream=%p)", //
         (void *)f, grid.x, grid.y, grid.z, block.x, block.y, block.z, args, sharedMemBytes, stream);
 
-    if (auto it = kernelNameToMetadata.find(f); it != kernelNameToMetadata.end()) {
-      log("\t%s<<<>>>", it->second.demangledName.c_str());
-      kernel::interceptKernelLaunch(f, it->second, args, grid, block, stream);
+    if (auto meta = findMetadata(f); meta) {
+      log("\t%s<<<>>>", meta->demangledName.c_str());
+      args = kernel::interceptKernelLaunch(f, *meta, args, grid, block, stream);
+      intercepted = true;
     } else
       log("[KERNEL] WARNING: Cannot find kernel metadata for fn pointer %p, interception function not invoked", f);
   }
   auto r = original(f, grid, block, args, sharedMemBytes, stream);
+  if (intercepted && r == hipSuccess) kernel::launchSubmitted(stream);
+  else if (intercepted) kernel::launchFailed();
   return r;
 }
 
@@ -124,18 +167,21 @@ extern "C" [[maybe_unused]] hipError_t hipModuleLaunchKernel( //
     hipStream_t stream,                                       //
     void **kernelParams,                                      //
     void **extra) {
-  auto original = dlSymbol<_hipModuleLaunchKernel>("hipModuleLaunchKernel", HipLibrarySO);
+  static auto original = dlSymbol<_hipModuleLaunchKernel>("hipModuleLaunchKernel", HipLibrarySO);
   log("hipModuleLaunchKernel(%p, ..., kernelParams=%p, sharedMemBytes=%d, stream=%p)", f, kernelParams, sharedMemBytes, stream);
+  bool intercepted = false;
   if (!inhibitInterception) {
-    auto name = reinterpret_cast<amdDeviceFunc *>(f)->name_;
-    if (auto it = std::find_if(kernelMetadata.begin(), kernelMetadata.end(), [&](auto &m) { return m.name == name; });
-        it != kernelMetadata.end()) {
-      log("\t%s<<<>>>", it->demangledName.c_str());
-      kernel::interceptKernelLaunch(f, *it, kernelParams, dim3{gridDimX, gridDimY, gridDimZ}, dim3{blockDimX, blockDimY, blockDimZ},
-                                    stream);
+    if (auto meta = findMetadata(f); meta) {
+      log("\t%s<<<>>>", meta->demangledName.c_str());
+      kernelParams = kernel::interceptKernelLaunch(f, *meta, kernelParams, dim3{gridDimX, gridDimY, gridDimZ},
+                                                   dim3{blockDimX, blockDimY, blockDimZ}, stream);
+      intercepted = true;
     } else
       log("[KERNEL] WARNING: Cannot find kernel metadata for fn pointer %p, interception function not invoked", f);
   }
-  return original(f, gridDimX, gridDimY, gridDimZ, blockDimX, blockDimY, blockDimZ, sharedMemBytes, stream, kernelParams, extra);
+  auto r = original(f, gridDimX, gridDimY, gridDimZ, blockDimX, blockDimY, blockDimZ, sharedMemBytes, stream, kernelParams, extra);
+  if (intercepted && r == hipSuccess) kernel::launchSubmitted(stream);
+  else if (intercepted) kernel::launchFailed();
+  return r;
 }
 } // namespace utpx
@@ -23,6 +23,12 @@ struct KernelMetadata {
 void suspendInterception();
 void resumeInterception();
 
-void interceptKernelLaunch(const void *fn, const HSACOKernelMeta &meta, void **args, dim3 grid, dim3 block, hipStream_t stream);
+// Returns the argument array to launch with, arguments holding mirrored host pointers are staged in thread-local storage that remains
+// valid until the next launch on the same thread. The caller's args are never modified.
+void **interceptKernelLaunch(const void *fn, const HSACOKernelMeta &meta, void **args, dim3 grid, dim3 block, hipStream_t stream);
+// Called once a launch that went through interceptKernelLaunch on this thread has been submitted to stream.
+void launchSubmitted(hipStream_t stream);
+// Called instead of launchSubmitted if that launch failed, so that it no longer holds on to the device copies it prepared.
+void launchFailed();
 
 } // namespace utpx::kernel
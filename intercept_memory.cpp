@@ -1,19 +1,31 @@
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
 #include <csignal>
 #include <cstdlib>
+#include <condition_variable>
 #include <cstring>
+#include <string>
+#include <utility>
 
 #include <thread>
 
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/userfaultfd.h>
 #include <optional>
 #include <poll.h>
 #include <semaphore.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
-#include <unordered_map>
+#include <vector>
 
 #include "intercept_memory.h"
+#include "interval_map.h"
+#include "stats.h"
+#include "userfaultfd.h"
 #include "utpx.h"
 
 namespace utpx::fault {
@@ -24,14 +36,90 @@ namespace detail {
 
 static long pageSize{};
 
+// How host accesses to device-owned data are caught, see UTPX_FAULT_BACKEND.
+enum class Backend {
+  Signal,      // mprotect + SIGSEGV, the signal handler parks the faulting thread until a handler thread has resolved the fault
+  Userfaultfd, // the kernel queues faults on a userfaultfd, device-owned pages are unpopulated and Shared pages are write-protected
+};
+static Backend backend = Backend::Signal;
+// False for a userfaultfd without write-protect support, host writes then go unnoticed so every migrated page is treated as dirty.
+static bool trackWrites = true;
+
 static long GUARD_THREAD_TIMEOUT_SECONDS = 10;
-static std::atomic_uintptr_t sigFaultAddress = 0;
-static sem_t sigHandlerPendingEvent{}, sigHandlerPendingResume{};
+
+// Every thread that takes a SIGSEGV claims its own slot and sleeps on it until a handler thread has resolved the fault.
+enum FaultSlotState : uint32_t { SlotFree, SlotFilling, SlotPending, SlotClaimed, SlotDone };
+struct FaultSlot {
+  std::atomic<uint32_t> state; // futex word, one of FaultSlotState
+  void *address;
+  bool isWrite;
+};
+static constexpr size_t maxFaultSlots = 256;
+static FaultSlot faultSlots[maxFaultSlots]{};
+static sem_t faultSlotsPending{}; // posted once for every slot moved to SlotPending
+
+// Registered ranges are protected and written back in chunks of chunkSize bytes (or whole if 0), see UTPX_CHUNK_SIZE.
+// A fault migrates the faulting chunk plus up to readAheadChunks protected chunks that follow it.
+static size_t chunkSize{};
+static size_t readAheadChunks{};
+// Host writes are tracked per page so that only modified pages are uploaded, until a chunk has taken this many write faults, at which
+// point the rest of the chunk is made writable and treated as dirty. See UTPX_DIRTY_PAGE_LIMIT.
+static size_t dirtyPageLimit{};
+
+struct RegisteredPage {
+  size_t chunkSize;
+  std::vector<ChunkState> chunks;
+  size_t hostChunks;                  // chunks not in ChunkState::DeviceOwned
+  std::vector<bool> dirtyPages;       // pages written by the host, only set in HostDirty chunks
+  std::vector<size_t> dirtyPageCount; // per chunk
+  uint64_t generation;                // bumped whenever the range is handed back to the device
+  size_t migrating;                   // write backs in flight, their chunks are in ChunkState::Migrating
+  size_t uploading;                   // hand-offs uploading without the locks, see releaseToDevice
+  std::atomic_bool *settled;          // the owner's flag, see registerPage and updateSettled
+  bool speculating;                   // a speculation token was taken since the last hand-off
+  // Host access history, rolled over by every launch that uses the range, see speculationToken.
+  bool touched;                       // the host faulted on the range since the last launch
+  size_t firstTouchPage;              // first page the host faulted on after the last launch it touched the range after
+  // After a speculative write back, the page the host touched first last time is kept inaccessible with its data set aside, so that we
+  // still see whether the host came back to the range. noPage if there's none pending.
+  size_t tripwire;
+  std::vector<char> tripwireData;
+};
+
+// Tells the owner whether handing the range to the device would be a no-op, as every chunk is device-owned and no write back, upload or
+// speculation token is outstanding. Must hold allocationLock exclusively, and be called before releasing it whenever that stops holding.
+// Launches that find it set skip the hand-off and faultIntakeLock with it: a fault whose thread was already woken by a write back cleared
+// it, and only a hand-off, which waits for such faults, sets it again.
+static void updateSettled(const RegisteredPage &page, bool registered = true) {
+  if (!page.settled) return;
+  page.settled->store(registered && page.hostChunks == 0 && !page.migrating && !page.uploading && !page.touched && !page.speculating,
+                      std::memory_order_release);
+}
+
+static constexpr size_t noPage = SIZE_MAX;
+static uint64_t nextGeneration = 1; // 0 is never a valid speculation token
 
 static std::shared_mutex allocationLock{};
-static std::unordered_map<void *, size_t> allocations{};
+// Held shared by a userfaultfd handler thread from reading a fault until it holds allocationLock, and exclusively (before allocationLock)
+// around every hand-off. Another handler may have woken the faulting thread long before its message is resolved, so without this a fault
+// read before a launch could be resolved after it and write the range back while the kernel uses it.
+static std::shared_mutex faultIntakeLock{};
+static IntervalMap<RegisteredPage> allocations{};
+static std::condition_variable_any uploadsDone{}; // notified under allocationLock whenever RegisteredPage::uploading drops
 
-// static std::atomic_flag sigFaultLatch = ATOMIC_FLAG_INIT;
+static stats::Counter faultsHandled("fault.handled");
+static stats::Counter chunksWrittenBack("fault.chunks.written_back");
+static stats::Counter pagesDirtied("fault.pages.dirtied");
+static stats::Counter uploads("fault.uploads");
+static stats::Counter faultsDeferred("fault.deferred");
+static stats::Counter speculativeWriteBacks("speculative.written_back");
+static stats::Counter speculativeUseful("speculative.useful");
+static stats::Counter speculativeWasted("speculative.wasted");
+
+static long futex(std::atomic<uint32_t> &word, int op, uint32_t value, const timespec *timeout = nullptr) {
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+  return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), op, value, timeout, nullptr, 0);
+}
 
 // FIXME we really need to adhere to signal-safety(7) in this whole block
 // XXX POSIX calls only in the handler!
@@ -40,44 +128,348 @@ static void handler(int signal, siginfo_t *siginfo, void *context) {
   if (signal != SIGSEGV || siginfo->si_code != SEGV_ACCERR) return;
   auto x86PC = static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_RIP];
   log("[MEM] SIGSEGV: Accessing memory at address %p, code=%d, pc=0x%llx", siginfo->si_addr, siginfo->si_code, x86PC); // FIXME AS unsafe
-  sigFaultAddress = reinterpret_cast<uintptr_t>(siginfo->si_addr);                                                     // AS safe
-  ::sem_post(&sigHandlerPendingEvent);                                                                                 // AS safe
-  timespec ts{};
-  if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {               // AS safe
+  FaultSlot *slot{};
+  while (!slot) { // all slots taken only if more than maxFaultSlots threads fault at once, wait for one to come free
+    for (auto &candidate : faultSlots) {
+      uint32_t expected = SlotFree;
+      if (candidate.state.compare_exchange_strong(expected, SlotFilling, std::memory_order_acquire)) {
+        slot = &candidate;
+        break;
+      }
+    }
+    if (!slot) sched_yield();
+  }
+  slot->isWrite = static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_ERR] & 0x2; // x86 #PF error code, bit 1 is set for writes
+  slot->address = siginfo->si_addr;
+  slot->state.store(SlotPending, std::memory_order_release);
+  ::sem_post(&faultSlotsPending); // AS safe
+  timespec deadline{};
+  if (clock_gettime(CLOCK_MONOTONIC, &deadline) == -1) {        // AS safe
     log("[MEM] SIGSEGV: clock_gettime failed, terminating..."); // FIXME AS unsafe
     ::abort();                                                  // AS safe
   }
-  ts.tv_sec += GUARD_THREAD_TIMEOUT_SECONDS;
-  int res = sem_timedwait(&sigHandlerPendingResume, &ts); // FIXME AS unsafe
-  if (res == -1) {
-    log("[MEM] SIGSEGV: resume timeout: guard thread did not respond within %lds, terminating...",
-        GUARD_THREAD_TIMEOUT_SECONDS); // FIXME AS unsafe
-    ::abort();
+  deadline.tv_sec += GUARD_THREAD_TIMEOUT_SECONDS;
+  for (uint32_t state; (state = slot->state.load(std::memory_order_acquire)) != SlotDone;) {
+    timespec now{}, remaining{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+    remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    if (remaining.tv_nsec < 0) remaining.tv_sec--, remaining.tv_nsec += 1000000000;
+    if (remaining.tv_sec < 0) {
+      log("[MEM] SIGSEGV: resume timeout: no handler thread resolved the fault within %lds, terminating...",
+          GUARD_THREAD_TIMEOUT_SECONDS); // FIXME AS unsafe
+      ::abort();
+    }
+    futex(slot->state, FUTEX_WAIT_PRIVATE, state, &remaining); // AS safe
   }
-  // while (sigFaultLatch.test_and_set(std::memory_order_acquire)) // AS safe
-  // {
-  // }
+  slot->state.store(SlotFree, std::memory_order_release);
   log("[MEM] SIGSEGV: resume %p", siginfo->si_addr); // FIXME AS unsafe
 }
 
-std::unique_ptr<std::thread> sigHandlerGuardThread{};
-std::atomic_bool sigHandlerTerminate;
+static void completeSlot(FaultSlot *slot) {
+  slot->state.store(SlotDone, std::memory_order_release);
+  futex(slot->state, FUTEX_WAKE_PRIVATE, 1);
+}
+
+// Faults are resolved by a pool of handler threads, see UTPX_FAULT_THREADS.
+static std::vector<std::thread> handlerThreads{};
+static std::atomic_bool sigHandlerTerminate;
+static int uffdTerminateEvent = -1;
+// Device data is written back through a per handler thread staging buffer and then published in one step, in pieces of at most stagingSize.
+static constexpr size_t stagingSize = 16 << 20;
+static thread_local char *staging{};
+static int selfMem = -1; // /proc/self/mem for the signal backend, -1 if unavailable
+// Signal slots waiting for a write back in flight on another handler thread, resumed together once it completes. The userfaultfd backend
+// doesn't need this as the kernel keeps those threads parked until the range is woken.
+static std::vector<FaultSlot *> parkedSlots{};
+
+static size_t pageAlign(size_t length) { return (length + pageSize - 1) / pageSize * pageSize; }
+
+static void setProtection(void *addr, size_t length, int prot) {
+  if (mprotect(addr, length, prot) != 0) {
+    fatal("[MEM]\tFATAL: mprotect(%p, %ld, %d) failed: %s", addr, length, prot, strerror(errno));
+  }
+}
+
+// Makes the host copy of [addr, addr + length) inaccessible so that the next access faults, the device copy must be up-to-date.
+static void revokeAccess(void *addr, size_t length) {
+  switch (backend) {
+    case Backend::Signal: setProtection(addr, length, PROT_NONE); break;
+    // dropped pages raise a missing fault on the next access, that's cheaper than keeping them write-protected, but splits huge pages, so
+    // the host arena only uses those with the signal backend
+    case Backend::Userfaultfd:
+      if (madvise(addr, pageAlign(length), MADV_DONTNEED) != 0)
+        fatal("[MEM]\tFATAL: madvise(%p, %ld, MADV_DONTNEED) failed: %s", addr, length, strerror(errno));
+      break;
+  }
+}
+
+// Makes [addr, addr + length) plainly accessible again, for ranges we stop tracking.
+static void restoreAccess(void *addr, size_t length) {
+  switch (backend) {
+    case Backend::Signal: setProtection(addr, length, PROT_READ | PROT_WRITE); break;
+    case Backend::Userfaultfd:
+      if (trackWrites) uffd::writeProtect(addr, pageAlign(length), false);
+      uffd::unregisterRange(addr, pageAlign(length));
+      break;
+  }
+}
+
+// Records a host write to the page at pageIndex and moves its chunk to HostDirty, returns the (offset, length) that should be made writable.
+// With wholeChunk, or once the chunk has reached dirtyPageLimit, the whole chunk is marked dirty instead.
+static std::pair<size_t, size_t> markDirty(RegisteredPage &page, size_t allocLength, size_t chunk, size_t pageIndex, bool wholeChunk = false) {
+  page.chunks[chunk] = ChunkState::HostDirty;
+  size_t chunkOffset = chunk * page.chunkSize;
+  size_t chunkLength = std::min(chunkOffset + page.chunkSize, allocLength) - chunkOffset;
+  if (wholeChunk || page.dirtyPageCount[chunk] >= dirtyPageLimit) {
+    size_t firstPage = chunkOffset / pageSize, lastPage = (chunkOffset + chunkLength + pageSize - 1) / pageSize;
+    std::fill(page.dirtyPages.begin() + firstPage, page.dirtyPages.begin() + lastPage, true);
+    pagesDirtied.add(lastPage - firstPage - page.dirtyPageCount[chunk]);
+    page.dirtyPageCount[chunk] = lastPage - firstPage;
+    return {chunkOffset, chunkLength};
+  }
+  page.dirtyPages[pageIndex] = true;
+  page.dirtyPageCount[chunk]++;
+  ++pagesDirtied;
+  size_t pageOffset = pageIndex * pageSize;
+  return {pageOffset, std::min<size_t>(pageOffset + pageSize, allocLength) - pageOffset};
+}
+
+// Makes [addr, addr + length) of a written back range writable for the host.
+static void allowWrite(void *addr, size_t length) {
+  if (backend == Backend::Userfaultfd) uffd::writeProtect(addr, pageAlign(length), false);
+  else
+    setProtection(addr, length, PROT_READ | PROT_WRITE);
+}
+
+// Makes [addr, addr + length) of a written back range read-only for the host again.
+static void denyWrite(void *addr, size_t length) {
+  if (backend == Backend::Userfaultfd) uffd::writeProtect(addr, pageAlign(length), true);
+  else
+    setProtection(addr, length, PROT_READ);
+}
+
+static char *mapStaging() {
+  auto buffer = mmap(nullptr, stagingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) fatal("[MEM] FATAL: Cannot map staging buffer, reason=%s, terminating...", strerror(errno));
+  return static_cast<char *>(buffer);
+}
+
+// Makes the first length bytes of the staging buffer visible at addr, read-only where host writes are tracked.
+static void publish(void *addr, size_t length) {
+  switch (backend) {
+    case Backend::Signal: {
+      // Unprotecting the range and copying into it would let other threads read it half-written, so write through /proc/self/mem, which
+      // ignores the protection of private mappings, and only unprotect once the range is complete. Falls back to copying when that's denied.
+      size_t written = 0;
+      while (selfMem != -1 && written < length) {
+        auto n = pwrite(selfMem, staging + written, length - written, reinterpret_cast<off_t>(static_cast<char *>(addr) + written));
+        if (n > 0) written += n;
+        else if (n == 0 || errno != EINTR) {
+          log("[MEM]\tUPH: writing through /proc/self/mem failed (%s), falling back to copying into unprotected ranges", strerror(errno));
+          ::close(selfMem);
+          selfMem = -1;
+        }
+      }
+      if (written < length) {
+        setProtection(addr, length, PROT_READ | PROT_WRITE);
+        std::memcpy(static_cast<char *>(addr) + written, staging + written, length - written);
+      }
+      setProtection(addr, length, PROT_READ);
+      break;
+    }
+    case Backend::Userfaultfd: uffd::copy(addr, staging, pageAlign(length), trackWrites); break;
+  }
+}
+
+// Resumes every thread that faulted on [addr, addr + length) while it was being written back.
+static void resumeWaiters(char *addr, size_t length) {
+  switch (backend) {
+    case Backend::Signal:
+      for (size_t i = 0; i < parkedSlots.size();) {
+        auto slotAddr = static_cast<char *>(parkedSlots[i]->address);
+        if (slotAddr < addr || slotAddr >= addr + length) {
+          i++;
+          continue;
+        }
+        completeSlot(parkedSlots[i]);
+        parkedSlots[i] = parkedSlots.back();
+        parkedSlots.pop_back();
+      }
+      break;
+    case Backend::Userfaultfd: uffd::wake(addr, pageAlign(length)); break;
+  }
+}
+
+// Writes back [offset, offset + length) of a run this thread has moved to ChunkState::Migrating, piece by piece through the staging buffer.
+// The allocation lock is only held to publish each piece so that write backs of different runs proceed in parallel, it is held again on
+// return. Returns false if the range was handed back to the device or unregistered in the meantime, the access then simply faults again.
+static bool migrate(std::unique_lock<std::shared_mutex> &write, void *faultAddr, uintptr_t base, uint64_t generation, size_t offset,
+                    size_t length) {
+  auto allocAddr = reinterpret_cast<char *>(base);
+  write.unlock(); // handleUserspaceFault takes the allocation lock on the other side, which is always acquired before ours
+  for (size_t done = 0; done < length; done += stagingSize) {
+    size_t pieceLength = std::min(stagingSize, length - done);
+    handleUserspaceFault(faultAddr, allocAddr, offset + done, pieceLength, staging);
+    write.lock();
+    auto it = allocations.find(base);
+    if (it == allocations.end() || it->value.generation != generation) {
+      log("[MEM]\tUPH: %p was released while writing back, dropping write back", allocAddr);
+      if (it != allocations.end()) it->value.migrating--;
+      return false;
+    }
+    publish(allocAddr + offset + done, pieceLength);
+    if (done + pieceLength < length) write.unlock();
+  }
+  allocations.find(base)->value.migrating--;
+  return true;
+}
 
-static void handleFault(void *faultAddr) {
-  log("[MEM]\tUPH guard thread handling fault at address %p", faultAddr);
-  if (const auto page = lookupRegisteredPage(faultAddr); page) {
-    const auto &[allocAddr, allocLength] = *page;
-    log("[MEM]\tSIGSEGV: resuming access to %p with mprotect(%p, %ld, PROT_READ | PROT_WRITE)", faultAddr, allocAddr, allocLength);
-    if (mprotect(allocAddr, allocLength, PROT_READ | PROT_WRITE) != 0) {
-      fatal("[MEM]\tFATAL: mprotect(%p, %ld, PROT_READ | PROT_WRITE) failed: %s", allocAddr, allocLength, strerror(errno));
+// Writes back chunks [first, last) of the registered range at base, which the caller has checked are device-owned, and commits them as
+// ChunkState::Shared. The lock is released while copying from the device, see migrate. Faults on the run that arrive in the meantime are
+// resumed once it completes. For a write fault, pageIndex is marked dirty. Returns false if the write back was dropped.
+static bool writeBackRun(std::unique_lock<std::shared_mutex> &write, void *faultAddr, uintptr_t base, size_t first, size_t last,
+                         bool isWrite, size_t pageIndex) {
+  auto it = allocations.find(base);
+  auto allocAddr = reinterpret_cast<char *>(base);
+  auto allocLength = it->size;
+  auto *page = &it->value;
+  size_t offset = first * page->chunkSize;
+  size_t length = std::min(last * page->chunkSize, allocLength) - offset;
+  log("[MEM]\tUPH: writing back %p+%ld for access to %p", allocAddr + offset, length, faultAddr);
+  // Chunk states are only committed once the data is published, so that a concurrent releaseToDevice never uploads stale pages.
+  std::fill(page->chunks.begin() + first, page->chunks.begin() + last, ChunkState::Migrating);
+  page->migrating++;
+  updateSettled(*page);
+  bool committed = migrate(write, faultAddr, base, page->generation, offset, length);
+  if (committed) {
+    page = &allocations.find(base)->value;
+    std::fill(page->chunks.begin() + first, page->chunks.begin() + last, ChunkState::Shared);
+    page->hostChunks += last - first;
+    chunksWrittenBack.add(last - first);
+    if (!trackWrites)
+      for (size_t c = first; c < last; ++c)
+        markDirty(*page, allocLength, c, c * page->chunkSize / pageSize, true);
+    else if (isWrite) {
+      auto [dirtyOffset, dirtyLength] = markDirty(*page, allocLength, first, pageIndex);
+      allowWrite(allocAddr + dirtyOffset, dirtyLength);
     }
-    handleUserspaceFault(faultAddr, allocAddr, allocLength);
-    sigFaultAddress = 0;
-    sem_post(&sigHandlerPendingResume);
-    // sigFaultLatch.clear(std::memory_order_release);
-  } else {
-    fatal("[MEM]\tFATAL: address %p is not a registered page", faultAddr);
   }
+  resumeWaiters(allocAddr + offset, length);
+  return committed;
+}
+
+enum class Resolution { Resolved, Deferred };
+
+// Resolves a host access to faultAddr. A fault on a run that another handler thread is already writing back is deferred instead, the
+// faulting thread is then resumed along with that write back. Signal faults pass their slot so that it can be parked until then, userfaultfd
+// faults pass their hold on faultIntakeLock, which is released once the fault is ordered against hand-offs.
+static Resolution resolveFault(void *faultAddr, bool isWrite, FaultSlot *slot, std::shared_lock<std::shared_mutex> *intake = nullptr) {
+  log("[MEM]\tUPH handling %s fault at address %p", isWrite ? "write" : "read", faultAddr);
+  auto faultAddrI = reinterpret_cast<uintptr_t>(faultAddr);
+  std::unique_lock<std::shared_mutex> write(allocationLock);
+  if (intake) intake->unlock();
+  auto it = allocations.findContaining(faultAddrI);
+  if (it == allocations.end()) fatal("[MEM]\tFATAL: address %p is not a registered page", faultAddr);
+  auto allocAddr = reinterpret_cast<char *>(it->base);
+  auto allocLength = it->size;
+  auto *page = &it->value;
+
+  size_t first = (faultAddrI - it->base) / page->chunkSize, last = first + 1;
+  auto state = page->chunks[first];
+  // For a device-owned chunk, extend into the read-ahead window for as long as the following chunks are still device-owned.
+  while (state == ChunkState::DeviceOwned && last < page->chunks.size() && last <= first + readAheadChunks &&
+         page->chunks[last] == ChunkState::DeviceOwned)
+    last++;
+  size_t pageIndex = (faultAddrI - it->base) / pageSize;
+
+  ++faultsHandled;
+  if (!page->touched) {
+    page->touched = true;
+    page->firstTouchPage = pageIndex;
+    updateSettled(*page);
+  }
+  if (pageIndex == page->tripwire) {
+    log("[MEM]\tUPH: host came back to speculatively written back %p", allocAddr);
+    ++speculativeUseful;
+    std::memcpy(staging, page->tripwireData.data(), pageSize);
+    publish(allocAddr + pageIndex * pageSize, pageSize);
+    // a write to another page may have made its whole chunk dirty meanwhile, the page must then stay writable
+    if (page->dirtyPages[pageIndex]) allowWrite(allocAddr + pageIndex * pageSize, pageSize);
+    page->tripwire = noPage;
+    page->tripwireData.clear();
+  }
+  switch (state) {
+    case ChunkState::DeviceOwned: writeBackRun(write, faultAddr, it->base, first, last, isWrite, pageIndex); break;
+    case ChunkState::Migrating:
+      log("[MEM]\tUPH: %p is being written back by another handler, waiting for it", faultAddr);
+      ++faultsDeferred;
+      if (slot) parkedSlots.push_back(slot);
+      return Resolution::Deferred;
+    case ChunkState::Shared: // fallthrough
+    case ChunkState::HostDirty:
+      if (!isWrite || page->dirtyPages[pageIndex]) {
+        log("[MEM]\tUPH: page at %p is already accessible", faultAddr);
+        break;
+      }
+      auto [dirtyOffset, dirtyLength] = markDirty(*page, allocLength, first, pageIndex);
+      log("[MEM]\tUPH: host write to %p, marking %p+%ld dirty", faultAddr, allocAddr + dirtyOffset, dirtyLength);
+      allowWrite(allocAddr + dirtyOffset, dirtyLength);
+      break;
+  }
+  return Resolution::Resolved;
+}
+
+static void signalHandlerThread() {
+  staging = mapStaging();
+  log("[MEM]\tUPH handler thread started");
+  while (true) {
+    if (sem_wait(&faultSlotsPending) == -1) {
+      if (errno == EINTR) continue;
+      std::abort();
+    }
+    if (sigHandlerTerminate) break;
+    // every post has a matching pending slot, but another handler thread may have claimed the one that was posted for us
+    for (auto &slot : faultSlots) {
+      uint32_t expected = SlotPending;
+      if (!slot.state.compare_exchange_strong(expected, SlotClaimed, std::memory_order_acquire)) continue;
+      if (resolveFault(slot.address, slot.isWrite, &slot) == Resolution::Resolved) completeSlot(&slot);
+      break;
+    }
+  }
+  munmap(staging, stagingSize);
+  log("[MEM]\tUPH handler thread terminated");
+}
+
+static void userfaultfdHandlerThread() {
+  staging = mapStaging();
+  log("[MEM]\tUFFD handler thread started");
+  pollfd fds[2] = {{.fd = uffd::fd(), .events = POLLIN, .revents = 0}, {.fd = uffdTerminateEvent, .events = POLLIN, .revents = 0}};
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      fatal("[MEM]\tUFFD poll failed: %s", strerror(errno));
+    }
+    if (fds[1].revents & POLLIN) break;
+    // one message at a time, so that queued faults spread over all handler threads
+    std::shared_lock<std::shared_mutex> intake(faultIntakeLock);
+    uffd_msg msg{};
+    if (read(uffd::fd(), &msg, sizeof(msg)) == -1) {
+      if (errno == EAGAIN) continue; // another handler thread took it
+      fatal("[MEM]\tUFFD read failed: %s", strerror(errno));
+    }
+    if (msg.event != UFFD_EVENT_PAGEFAULT) {
+      log("[MEM]\tUFFD ignoring event %d", msg.event);
+      continue;
+    }
+    auto address = msg.arg.pagefault.address;
+    // the faulting page may have been resolved by an earlier fault in the same run, so always wake it ourselves
+    if (resolveFault(reinterpret_cast<void *>(address), msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE, nullptr, &intake) ==
+        Resolution::Resolved)
+      uffd::wake(reinterpret_cast<void *>(address & ~uintptr_t(pageSize - 1)), pageSize);
+  }
+  munmap(staging, stagingSize);
+  log("[MEM]\tUFFD handler thread terminated");
 }
 
 void initialiseUserspacePagefaultHandling() {
@@ -86,70 +478,321 @@ void initialiseUserspacePagefaultHandling() {
   if (pageSize != -1) log("[MEM] page size = %ld", pageSize);
   else
     fatal("[MEM] Cannot resolve page size with sysconf, reason=%s, terminating...", strerror(errno));
-  if (sem_init(&sigHandlerPendingEvent, 0, 0) == -1)
-    fatal("[MEM] FATAL: Cannot create semaphore for sigHandlerPendingEvent, reason=%s, terminating...", strerror(errno));
-  if (sem_init(&sigHandlerPendingResume, 0, 0) == -1)
-    fatal("[MEM] FATAL: Cannot create semaphore for sigHandlerPendingResume, reason=%s, terminating...", strerror(errno));
-  log("[MEM] UPH initialised");
-
-  struct sigaction act {};
-  sigemptyset(&act.sa_mask);
-  act.sa_flags = SA_SIGINFO | SA_ONSTACK;
-  act.sa_sigaction = handler;
-  sigaction(SIGSEGV, &act, nullptr);
-  log("[MEM] UPH signal handler installed");
-
-  sem_post(&sigHandlerPendingEvent);
-  sigHandlerGuardThread = std::make_unique<std::thread>([]() {
-    log("[MEM]\tUPH guard thread started");
-    while (true) {
-      if (sem_wait(&sigHandlerPendingEvent) == -1) {
-        std::abort();
-      }
-      if (sigHandlerTerminate) break;
-      auto address = sigFaultAddress.load();
-      if (address) handleFault(reinterpret_cast<void *>(address));
+  chunkSize = (envBytes("UTPX_CHUNK_SIZE", 0) + pageSize - 1) / pageSize * pageSize; // protection works on whole pages
+  readAheadChunks = envCount("UTPX_CHUNK_READAHEAD", 0);
+  dirtyPageLimit = envCount("UTPX_DIRTY_PAGE_LIMIT", 16);
+  if (chunkSize) log("[MEM] chunk size = %zu, read-ahead = %zu chunks", chunkSize, readAheadChunks);
+  else
+    log("[MEM] chunk size = whole allocation");
+
+  std::string requested = std::getenv("UTPX_FAULT_BACKEND") ? std::getenv("UTPX_FAULT_BACKEND") : "";
+  if (!requested.empty() && requested != "SIGNAL" && requested != "USERFAULTFD")
+    fatal("[MEM] Unknown UTPX_FAULT_BACKEND %s, terminating...", requested.c_str());
+  if (requested != "SIGNAL" && uffd::open(trackWrites)) backend = Backend::Userfaultfd;
+  else if (requested == "USERFAULTFD")
+    fatal("[MEM] UTPX_FAULT_BACKEND=USERFAULTFD requested but userfaultfd is unavailable, terminating...");
+
+  size_t threads = envCount("UTPX_FAULT_THREADS", std::clamp(std::thread::hardware_concurrency(), 1u, 8u));
+  if (threads == 0) fatal("[MEM] UTPX_FAULT_THREADS must be at least 1, terminating...");
+  switch (backend) {
+    case Backend::Signal: {
+      if (sem_init(&faultSlotsPending, 0, 0) == -1)
+        fatal("[MEM] FATAL: Cannot create semaphore for faultSlotsPending, reason=%s, terminating...", strerror(errno));
+      if ((selfMem = open("/proc/self/mem", O_RDWR | O_CLOEXEC)) == -1) log("[MEM] Cannot open /proc/self/mem: %s", strerror(errno));
+      struct sigaction act {};
+      sigemptyset(&act.sa_mask);
+      act.sa_flags = SA_SIGINFO | SA_ONSTACK;
+      act.sa_sigaction = handler;
+      sigaction(SIGSEGV, &act, nullptr);
+      log("[MEM] UPH signal handler installed");
+      for (size_t i = 0; i < threads; ++i)
+        handlerThreads.emplace_back(signalHandlerThread);
+      break;
     }
-    log("[MEM]\tUPH guard thread terminated");
-  });
-  log("[MEM] UPH initialised");
+    case Backend::Userfaultfd:
+      if ((uffdTerminateEvent = eventfd(0, EFD_CLOEXEC)) == -1)
+        fatal("[MEM] FATAL: Cannot create eventfd, reason=%s, terminating...", strerror(errno));
+      for (size_t i = 0; i < threads; ++i)
+        handlerThreads.emplace_back(userfaultfdHandlerThread);
+      break;
+  }
+  log("[MEM] UPH initialised, backend=%s, write tracking=%d, handler threads=%zu", backend == Backend::Signal ? "signal" : "userfaultfd",
+      trackWrites, threads);
 }
 
 void terminateUserspacePagefaultHandling() {
   log("[MEM] UPH termination requested");
-  std::unique_lock<std::shared_mutex> write(allocationLock);
-  for (auto &[ptr, size] : allocations) {
-    log("[MEM]\trelease: %p, %ld", ptr, size);
-    if (mprotect(ptr, size, PROT_READ | PROT_WRITE) != 0) {
-      log("[MEM]\tWARN: mprotect(%p, %ld, PROT_READ | PROT_WRITE) failed: %s", ptr, size, strerror(errno));
+  {
+    std::unique_lock<std::shared_mutex> intake(faultIntakeLock);
+    std::unique_lock<std::shared_mutex> write(allocationLock);
+    for (auto &[base, size, page] : allocations) {
+      auto ptr = reinterpret_cast<void *>(base);
+      log("[MEM]\trelease: %p, %ld", ptr, size);
+      restoreAccess(ptr, size);
     }
+    allocations.clear();
   }
-  sigHandlerTerminate = true;
-  sem_post(&sigHandlerPendingEvent);
-  if (sigHandlerGuardThread) sigHandlerGuardThread->join();
+  switch (backend) {
+    case Backend::Signal:
+      sigHandlerTerminate = true;
+      for (size_t i = 0; i < handlerThreads.size(); ++i)
+        sem_post(&faultSlotsPending);
+      break;
+    case Backend::Userfaultfd: // the eventfd stays readable, so this stops every handler thread
+      if (eventfd_write(uffdTerminateEvent, 1) == -1) fatal("[MEM] eventfd_write failed: %s", strerror(errno));
+      break;
+  }
+  for (auto &thread : handlerThreads)
+    thread.join();
+  handlerThreads.clear();
+  if (backend == Backend::Userfaultfd) uffd::close();
   log("[MEM] UPH terminated");
 }
 
-void registerPage(void *ptr, size_t size) {
+// Called whenever the range goes back to the device, drops write backs still in flight.
+static void handOff(RegisteredPage &page) {
+  page.generation = nextGeneration++;
+  page.speculating = false;
+  if (page.tripwire != noPage) {
+    ++speculativeWasted;
+    page.tripwire = noPage;
+    page.tripwireData.clear();
+  }
+}
+
+// Waits for any upload of the registered range at base that releaseToDevice runs without the locks, which are both held again on return.
+// Returns the range, or the end if base isn't registered.
+static IntervalMap<RegisteredPage>::iterator awaitUploads(std::unique_lock<std::shared_mutex> &intake,
+                                                          std::unique_lock<std::shared_mutex> &write, uintptr_t base) {
+  auto it = allocations.find(base);
+  while (it != allocations.end() && it->value.uploading) {
+    intake.unlock(); // the upload takes it again before allocationLock to commit
+    uploadsDone.wait(write);
+    write.unlock();
+    intake.lock();
+    write.lock();
+    it = allocations.find(base);
+  }
+  return it;
+}
+
+void registerPage(void *ptr, size_t size, std::atomic_bool *settled) {
+  std::unique_lock<std::shared_mutex> intake(faultIntakeLock);
   std::unique_lock<std::shared_mutex> write(allocationLock);
+  awaitUploads(intake, write, reinterpret_cast<uintptr_t>(ptr));
   log("[MEM] UPH register page (%p, %ld) total=%zu", ptr, size, allocations.size());
-  auto [_, inserted] = allocations.emplace(ptr, size);
-  if (inserted) {
-    if (mprotect(ptr, size, PROT_NONE) != 0) {
-      fatal("[MEM] mprotect failed, reason=%s, terminating...", strerror(errno));
+  auto pageChunkSize = chunkSize && chunkSize < size ? chunkSize : size;
+  auto chunks = (size + pageChunkSize - 1) / pageChunkSize;
+  auto [it, inserted] = allocations.emplace(reinterpret_cast<uintptr_t>(ptr), size,
+                                            RegisteredPage{.chunkSize = pageChunkSize,
+                                                           .chunks = std::vector<ChunkState>(chunks, ChunkState::DeviceOwned),
+                                                           .hostChunks = 0,
+                                                           .dirtyPages = std::vector<bool>((size + pageSize - 1) / pageSize),
+                                                           .dirtyPageCount = std::vector<size_t>(chunks),
+                                                           .generation = nextGeneration++,
+                                                           .migrating = 0,
+                                                           .uploading = 0,
+                                                           .settled = settled,
+                                                           .speculating = false,
+                                                           .touched = false,
+                                                           .firstTouchPage = noPage,
+                                                           .tripwire = noPage,
+                                                           .tripwireData = {}});
+  if (inserted && backend == Backend::Userfaultfd) uffd::registerRange(ptr, pageAlign(size));
+  if (!inserted) {
+    if (it->base != reinterpret_cast<uintptr_t>(ptr) || it->size != size)
+      fatal("[MEM] UPH page (%p, %ld) overlaps registered page (0x%lx, %ld)", ptr, size, it->base, it->size);
+    if (settled) it->value.settled = settled;
+    handOff(it->value);
+    if (it->value.hostChunks == 0 && !it->value.migrating) {
+      log("[MEM] UPH page already registered");
+      updateSettled(it->value);
+      return;
     }
-  } else {
-    log("[MEM] UPH page already registered");
+    log("[MEM] UPH page already registered with %zu/%zu chunks accessible from host, protecting again", it->value.hostChunks, chunks);
+    std::fill(it->value.chunks.begin(), it->value.chunks.end(), ChunkState::DeviceOwned);
+    std::fill(it->value.dirtyPages.begin(), it->value.dirtyPages.end(), false);
+    std::fill(it->value.dirtyPageCount.begin(), it->value.dirtyPageCount.end(), 0);
+    it->value.hostChunks = 0;
   }
+  updateSettled(it->value);
+  revokeAccess(ptr, size);
+}
+
+bool releaseToDevice(void *ptr, const std::function<void(size_t, size_t)> &upload) {
+  auto base = reinterpret_cast<uintptr_t>(ptr);
+  std::unique_lock<std::shared_mutex> intake(faultIntakeLock);
+  std::unique_lock<std::shared_mutex> write(allocationLock);
+  auto it = awaitUploads(intake, write, base);
+  if (it == allocations.end()) return false;
+  auto *page = &it->value;
+  auto tripwire = page->tripwire;
+  handOff(*page);
+  if (page->hostChunks == 0 && !page->migrating) {
+    updateSettled(*page);
+    return true;
+  }
+  // Collect runs of dirty pages, coalescing across chunk boundaries.
+  std::vector<std::pair<size_t, size_t>> runs;
+  size_t runBegin = 0, runEnd = 0;
+  auto endRun = [&]() {
+    if (runBegin == runEnd) return;
+    size_t offset = runBegin * pageSize;
+    runs.emplace_back(offset, std::min<size_t>(runEnd * pageSize, it->size) - offset);
+    runBegin = runEnd = 0;
+  };
+  for (size_t c = 0; c < page->chunks.size(); ++c) {
+    if (page->chunks[c] != ChunkState::HostDirty) continue;
+    size_t firstPage = c * page->chunkSize / pageSize;
+    size_t lastPage = std::min((c * page->chunkSize + page->chunkSize + pageSize - 1) / pageSize, page->dirtyPages.size());
+    for (size_t p = firstPage; p < lastPage; ++p) {
+      if (!page->dirtyPages[p]) continue;
+      page->dirtyPages[p] = false;
+      // A tripwire page marked dirty along with its chunk hasn't been accessed since it was set aside, or it would have been restored. It
+      // is still unpopulated with the userfaultfd backend, and the device has its data anyway.
+      if (p == tripwire) continue;
+      if (p != runEnd) endRun();
+      if (runBegin == runEnd) runBegin = p;
+      runEnd = p + 1;
+    }
+    page->dirtyPageCount[c] = 0;
+  }
+  endRun();
+  auto uploadRuns = [&]() {
+    for (auto [offset, length] : runs) {
+      log("[MEM] UPH uploading host-dirty pages %p+%ld", static_cast<char *>(ptr) + offset, length);
+      upload(offset, length);
+      ++uploads;
+    }
+  };
+  // The DMA runs without the locks, so that faults on other ranges aren't held up by it. Host chunks stay readable meanwhile, but become
+  // Migrating with their dirty pages write-protected again, so that a host write waits for the hand-off like a fault on a write back in
+  // flight rather than landing after its page was read. Without write tracking a write can't be held up, so the upload keeps the locks.
+  if (!runs.empty() && (backend == Backend::Signal || trackWrites)) {
+    for (auto &state : page->chunks)
+      if (state == ChunkState::Shared || state == ChunkState::HostDirty) state = ChunkState::Migrating;
+    for (auto [offset, length] : runs)
+      denyWrite(static_cast<char *>(ptr) + offset, length);
+    page->uploading++;
+    write.unlock();
+    intake.unlock();
+    uploadRuns();
+    intake.lock();
+    write.lock();
+    it = allocations.find(base); // hand-offs and unregistering wait for us, only terminating doesn't
+    if (it != allocations.end()) it->value.uploading--;
+    uploadsDone.notify_all();
+    if (it == allocations.end()) return true;
+    page = &it->value;
+    handOff(*page); // drops write backs of device-owned chunks that started meanwhile
+  } else
+    uploadRuns();
+  log("[MEM] UPH releasing %zu/%zu host chunks of (%p, %ld) to device", page->hostChunks, page->chunks.size(), ptr, it->size);
+  std::fill(page->chunks.begin(), page->chunks.end(), ChunkState::DeviceOwned);
+  page->hostChunks = 0;
+  updateSettled(*page);
+  revokeAccess(ptr, it->size);
+  resumeWaiters(static_cast<char *>(ptr), it->size); // host writes held up by the upload fault again, now on device-owned chunks
+  return true;
+}
+
+uint64_t speculationToken(void *ptr, bool always, bool &touched) {
+  touched = false;
+  {
+    // most launches find the range untouched, which launching threads can check side by side
+    std::shared_lock<std::shared_mutex> read(allocationLock);
+    auto it = allocations.find(reinterpret_cast<uintptr_t>(ptr));
+    if (it == allocations.end()) return 0;
+    if (!it->value.touched && !(always && trackWrites)) return 0;
+  }
+  std::unique_lock<std::shared_mutex> write(allocationLock);
+  auto it = allocations.find(reinterpret_cast<uintptr_t>(ptr));
+  if (it == allocations.end()) return 0;
+  touched = std::exchange(it->value.touched, false);
+  // without write tracking every written back page would have to be uploaded again, which defeats the point
+  auto token = (touched || always) && trackWrites ? it->value.generation : 0;
+  if (token) it->value.speculating = true;
+  updateSettled(it->value);
+  return token;
+}
+
+void writeBackSpeculatively(void *ptr, uint64_t token) {
+  auto base = reinterpret_cast<uintptr_t>(ptr);
+  if (!staging) staging = mapStaging(); // called from outside the handler threads, the mapping lives as long as the calling thread
+  std::unique_lock<std::shared_mutex> write(allocationLock);
+  for (size_t first = 0;;) {
+    auto it = allocations.find(base);
+    if (it == allocations.end() || it->value.generation != token) return; // handed to the device again since
+    auto &chunks = it->value.chunks;
+    while (first < chunks.size() && chunks[first] != ChunkState::DeviceOwned)
+      first++;
+    if (first == chunks.size()) break;
+    size_t last = first + 1;
+    while (last < chunks.size() && chunks[last] == ChunkState::DeviceOwned)
+      last++;
+    if (!writeBackRun(write, nullptr, base, first, last, false, noPage)) return;
+    speculativeWriteBacks.add(last - first);
+    first = last;
+  }
+  auto &page = allocations.find(base)->value;
+  auto tripwire = page.firstTouchPage;
+  // a chunk another handler is still writing back isn't populated yet, reading it here would fault while holding allocationLock
+  if (tripwire == noPage || page.tripwire != noPage || page.dirtyPages[tripwire] ||
+      page.chunks[tripwire * pageSize / page.chunkSize] != ChunkState::Shared)
+    return;
+  auto tripwireAddr = static_cast<char *>(ptr) + tripwire * pageSize;
+  page.tripwireData.assign(tripwireAddr, tripwireAddr + pageSize);
+  page.tripwire = tripwire;
+  revokeAccess(tripwireAddr, pageSize);
+}
+
+bool reclaimFromDevice(void *ptr, const std::function<void(size_t, size_t, void *)> &download) {
+  std::unique_lock<std::shared_mutex> intake(faultIntakeLock);
+  std::unique_lock<std::shared_mutex> write(allocationLock);
+  auto it = awaitUploads(intake, write, reinterpret_cast<uintptr_t>(ptr));
+  if (it == allocations.end()) return false;
+  log("[MEM] UPH reclaiming (%p, %ld) from device", ptr, it->size);
+  if (!staging) staging = mapStaging(); // see writeBackSpeculatively
+  auto allocAddr = static_cast<char *>(ptr);
+  auto &page = it->value;
+  if (page.tripwire != noPage) {
+    std::memcpy(staging, page.tripwireData.data(), pageSize);
+    publish(allocAddr + page.tripwire * pageSize, pageSize);
+  }
+  handOff(page);
+  // Chunks a handler thread is writing back are fetched here as well, that write back is dropped as the range is gone once it completes.
+  auto onDevice = [&](size_t c) { return page.chunks[c] == ChunkState::DeviceOwned || page.chunks[c] == ChunkState::Migrating; };
+  for (size_t first = 0; first < page.chunks.size();) {
+    if (!onDevice(first)) {
+      first++;
+      continue;
+    }
+    size_t last = first + 1;
+    while (last < page.chunks.size() && onDevice(last))
+      last++;
+    size_t offset = first * page.chunkSize;
+    size_t length = std::min(last * page.chunkSize, it->size) - offset;
+    for (size_t done = 0; done < length; done += stagingSize) {
+      size_t pieceLength = std::min(stagingSize, length - done);
+      download(offset + done, pieceLength, staging);
+      publish(allocAddr + offset + done, pieceLength);
+    }
+    first = last;
+  }
+  updateSettled(page, false);
+  restoreAccess(ptr, it->size);
+  allocations.erase(it);
+  return true;
 }
 
 void unregisterPage(void *ptr) {
+  std::unique_lock<std::shared_mutex> intake(faultIntakeLock);
   std::unique_lock<std::shared_mutex> write(allocationLock);
   log("[MEM] UPH unregister page (%p)", ptr);
-  if (auto it = allocations.find(ptr); it != allocations.end()) {
-    if (mprotect(it->first, it->second, PROT_READ | PROT_WRITE) != 0) {
-      fatal("[MEM]\tmprotect(%p, %ld, PROT_READ | PROT_WRITE) failed: %s", it->first, it->second, strerror(errno));
-    }
+  if (auto it = awaitUploads(intake, write, reinterpret_cast<uintptr_t>(ptr)); it != allocations.end()) {
+    handOff(it->value);
+    updateSettled(it->value, false);
+    restoreAccess(ptr, it->size);
     allocations.erase(it);
   } else
     fatal("[MEM] UPH unregister nonexistent page (%p)", ptr);
@@ -157,20 +800,14 @@ void unregisterPage(void *ptr) {
 
 std::optional<std::pair<void *, size_t>> lookupRegisteredPage(const void *ptr) {
   std::shared_lock<std::shared_mutex> read(allocationLock);
-  for (auto &[addr, length] : allocations) {
-    //    log("[MEM] \tUPH page (%p, %ld)", addr, length);
-
-    auto signalAddrI = reinterpret_cast<uintptr_t>(ptr);
-    auto allocAddrI = reinterpret_cast<uintptr_t>(addr);
-    if (signalAddrI >= allocAddrI && signalAddrI < (allocAddrI + length)) {
-      // std::fprintf(stderr, "offset from base=%d", (( ((uintptr_t) faultAddr)) - ( (uintptr_t) addr)));
-      // size = length - (reinterpret_cast<uintptr_t>(faultAddr) - reinterpret_cast<uintptr_t>(addr));
-      return std::pair{addr, length};
-    }
+  if (auto it = allocations.findContaining(reinterpret_cast<uintptr_t>(ptr)); it != allocations.end()) {
+    return std::pair{reinterpret_cast<void *>(it->base), it->size};
   }
   return {};
 }
 
 size_t hostPageSize() { return pageSize; }
 
+bool keepsHostPages() { return backend == Backend::Signal; }
+
 } // namespace utpx::fault
@@ -1,18 +1,52 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <list>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
 
 namespace utpx::fault {
 
+// Coherence state of one chunk of a registered range, ranges that are not registered are host-only.
+// Protections are given for the signal backend, the userfaultfd backend drops device-owned pages and write-protects shared ones instead.
+enum class ChunkState : uint8_t {
+  DeviceOwned, // PROT_NONE, the device copy is authoritative and any host access writes the chunk back
+  Migrating,   // PROT_NONE, being written back by a handler thread, other faults on it wait for that write back to complete
+  Shared,      // PROT_READ, both copies are valid, a host write moves the chunk to HostDirty
+  HostDirty,   // PROT_READ | PROT_WRITE, the host copy is authoritative and is uploaded before the device uses it again
+};
+
 void initialiseUserspacePagefaultHandling();
 void terminateUserspacePagefaultHandling();
-void registerPage(void *ptr, size_t size);
+// Starts tracking [ptr, ptr + size) with every chunk device-owned, or hands every chunk back to the device if already registered.
+// settled, if given, is kept set for as long as releaseToDevice would have nothing to upload and the range nothing to order against, so
+// that launches can skip it without taking a lock. It must outlive the registration.
+void registerPage(void *ptr, size_t size, std::atomic_bool *settled = nullptr);
+// Calls upload(offset, length) for every run of host-dirty chunks of the registered range at ptr, then makes every chunk device-owned.
+// Returns false if ptr is not the base of a registered range.
+bool releaseToDevice(void *ptr, const std::function<void(size_t, size_t)> &upload);
+// Returns a token for speculatively writing back the registered range at ptr after the kernel that is about to use it, or 0 if the host
+// did not touch the range after the previous launch and isn't expected to touch it this time either, unless always. Sets touched to
+// whether it did. Call once per launch, after the range has been handed to the device, as this starts a new history interval.
+[[nodiscard]] uint64_t speculationToken(void *ptr, bool always, bool &touched);
+// Writes back every device-owned chunk of the registered range at ptr ahead of host accesses, unless the range has been handed to the device
+// again since token was taken. Must not be called before the device is done with the range.
+void writeBackSpeculatively(void *ptr, uint64_t token);
+// Makes the host copy of the registered range at ptr authoritative and stops tracking it, for when its device copy is about to be freed.
+// Calls download(offset, length, dst) to fetch every run of chunks the device owns. Returns false if ptr is not the base of a registered range.
+bool reclaimFromDevice(void *ptr, const std::function<void(size_t, size_t, void *)> &download);
 void unregisterPage(void *ptr);
 [[nodiscard]] std::optional<std::pair<void *, size_t>> lookupRegisteredPage(const void *ptr);
 [[nodiscard]] size_t hostPageSize();
+// Whether registered ranges keep their physical pages while protected, memory pinned for DMA relies on that. The userfaultfd backend drops
+// device-owned pages instead, so pinned pages would no longer be the ones mapped once the range comes back.
+[[nodiscard]] bool keepsHostPages();
 
-void handleUserspaceFault(void *faultAddr, void *allocAddr, size_t allocLength);
+// Copies [offset, offset + length) of the device copy of the registered allocation at allocAddr to dst, which is either the already
+// unprotected host range itself or a staging buffer that the fault backend maps in afterwards.
+void handleUserspaceFault(void *faultAddr, void *allocAddr, size_t offset, size_t length, void *dst);
 
 } // namespace utpx::fault
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace utpx {
+
+// A sorted flat array of disjoint [base, base + size) ranges keyed by base address.
+// Containment lookups are a binary search, and addresses outside [lowerBound(), upperBound()) are rejected with two compares.
+// Inserts and erases shift the tail of the array, which is fine as allocations change far less often than they are looked up.
+template <typename V> class IntervalMap {
+public:
+  struct Entry {
+    uintptr_t base;
+    size_t size;
+    V value;
+    [[nodiscard]] uintptr_t end() const { return base + size; }
+    [[nodiscard]] bool contains(uintptr_t ptr) const { return ptr >= base && ptr < base + size; }
+  };
+  using iterator = typename std::vector<Entry>::iterator;
+  using const_iterator = typename std::vector<Entry>::const_iterator;
+
+private:
+  std::vector<Entry> entries;
+  uintptr_t lo = UINTPTR_MAX, hi = 0;
+
+  void updateBounds() {
+    // ranges are disjoint and sorted, so the last entry also has the highest end address
+    lo = entries.empty() ? UINTPTR_MAX : entries.front().base;
+    hi = entries.empty() ? 0 : entries.back().end();
+  }
+
+  template <typename It> static It lowerBound(It begin, It end, uintptr_t base) {
+    return std::lower_bound(begin, end, base, [](const Entry &e, uintptr_t b) { return e.base < b; });
+  }
+
+  template <typename It> static It find(It begin, It end, uintptr_t base) {
+    auto it = lowerBound(begin, end, base);
+    return it != end && it->base == base ? it : end;
+  }
+
+  template <typename It> static It findContaining(It begin, It end, uintptr_t ptr) {
+    auto it = std::upper_bound(begin, end, ptr, [](uintptr_t p, const Entry &e) { return p < e.base; });
+    if (it == begin) return end;
+    --it;
+    return it->contains(ptr) ? it : end;
+  }
+
+public:
+  [[nodiscard]] iterator begin() { return entries.begin(); }
+  [[nodiscard]] iterator end() { return entries.end(); }
+  [[nodiscard]] const_iterator begin() const { return entries.begin(); }
+  [[nodiscard]] const_iterator end() const { return entries.end(); }
+  [[nodiscard]] size_t size() const { return entries.size(); }
+  [[nodiscard]] bool empty() const { return entries.empty(); }
+
+  // [lowerBound(), upperBound()) covers every tracked range, anything outside cannot be in the map
+  [[nodiscard]] uintptr_t lowerBound() const { return lo; }
+  [[nodiscard]] uintptr_t upperBound() const { return hi; }
+  [[nodiscard]] bool outside(uintptr_t ptr) const { return ptr < lo || ptr >= hi; }
+
+  // Inserts [base, base + size), fails if the range overlaps an existing entry.
+  std::pair<iterator, bool> emplace(uintptr_t base, size_t size, V value) {
+    auto it = lowerBound(entries.begin(), entries.end(), base);
+    if (it != entries.end() && it->base < base + size) return {it, false};
+    if (it != entries.begin() && std::prev(it)->end() > base) return {std::prev(it), false};
+    it = entries.insert(it, Entry{base, size, std::move(value)});
+    updateBounds();
+    return {it, true};
+  }
+
+  // Finds the entry that starts exactly at base.
+  [[nodiscard]] iterator find(uintptr_t base) { return find(entries.begin(), entries.end(), base); }
+  [[nodiscard]] const_iterator find(uintptr_t base) const { return find(entries.begin(), entries.end(), base); }
+
+  // Finds the entry whose range contains ptr.
+  [[nodiscard]] iterator findContaining(uintptr_t ptr) {
+    return outside(ptr) ? entries.end() : findContaining(entries.begin(), entries.end(), ptr);
+  }
+  [[nodiscard]] const_iterator findContaining(uintptr_t ptr) const {
+    return outside(ptr) ? entries.end() : findContaining(entries.begin(), entries.end(), ptr);
+  }
+
+  iterator erase(iterator it) {
+    auto next = entries.erase(it);
+    updateBounds();
+    return next;
+  }
+
+  void clear() {
+    entries.clear();
+    updateBounds();
+  }
+};
+
+// An IntervalMap for snapshots that are copied on every update: entries are kept in sorted chunks of at most MaxChunk entries that copies
+// share, so copying the map copies only the array of chunk pointers, and an update clones just the chunk it changes. A published copy must
+// not be updated, entry references stay valid for as long as any copy that holds their chunk.
+template <typename V, size_t MaxChunk = 256> class ChunkedIntervalMap {
+public:
+  using Entry = typename IntervalMap<V>::Entry;
+
+private:
+  using Chunk = std::vector<Entry>;
+  std::vector<std::shared_ptr<const Chunk>> chunks; // sorted and never empty
+  std::vector<uintptr_t> firstBases;               // of each chunk, so that a lookup searches a flat array before the chunk
+  size_t count = 0;
+  uintptr_t lo = UINTPTR_MAX, hi = 0;
+
+  void updateBounds() {
+    lo = chunks.empty() ? UINTPTR_MAX : chunks.front()->front().base;
+    hi = chunks.empty() ? 0 : chunks.back()->back().end();
+  }
+
+  // The chunk the entry at base is in or would go into: the last one starting at or before it, or the first if there is none.
+  [[nodiscard]] size_t chunkFor(uintptr_t base) const {
+    auto it = std::upper_bound(firstBases.begin(), firstBases.end(), base);
+    return it == firstBases.begin() ? 0 : size_t(it - firstBases.begin()) - 1;
+  }
+
+  // Replaces chunk c with a private copy that update changes, then splits it if it grew too large, or merges it into a neighbour if it
+  // shrank so far that the two fit in one chunk, so that there are never many more chunks than a full map needs.
+  template <typename F> void updateChunk(size_t c, F update) {
+    auto chunk = std::make_shared<Chunk>(*chunks[c]);
+    update(*chunk);
+    if (chunk->size() > MaxChunk) {
+      auto upper = std::make_shared<const Chunk>(chunk->begin() + chunk->size() / 2, chunk->end());
+      chunk->erase(chunk->begin() + chunk->size() / 2, chunk->end());
+      chunks.insert(chunks.begin() + c + 1, std::move(upper));
+    } else if (chunk->size() < MaxChunk / 4) {
+      if (c + 1 < chunks.size() && chunk->size() + chunks[c + 1]->size() <= MaxChunk) {
+        chunk->insert(chunk->end(), chunks[c + 1]->begin(), chunks[c + 1]->end());
+        chunks.erase(chunks.begin() + c + 1);
+      } else if (c > 0 && chunks[c - 1]->size() + chunk->size() <= MaxChunk) {
+        chunk->insert(chunk->begin(), chunks[c - 1]->begin(), chunks[c - 1]->end());
+        chunks.erase(chunks.begin() + --c);
+      }
+    }
+    if (chunk->empty()) chunks.erase(chunks.begin() + c);
+    else
+      chunks[c] = std::move(chunk);
+    firstBases.resize(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i)
+      firstBases[i] = chunks[i]->front().base;
+    updateBounds();
+  }
+
+public:
+  class const_iterator {
+  public:
+    const_iterator(const ChunkedIntervalMap *map, size_t chunk, size_t index) : map(map), chunk(chunk), index(index) {}
+    const Entry &operator*() const { return (*map->chunks[chunk])[index]; }
+    const Entry *operator->() const { return &**this; }
+    const_iterator &operator++() {
+      if (++index == map->chunks[chunk]->size()) {
+        chunk++;
+        index = 0;
+      }
+      return *this;
+    }
+    bool operator==(const const_iterator &that) const { return chunk == that.chunk && index == that.index; }
+    bool operator!=(const const_iterator &that) const { return !(*this == that); }
+
+  private:
+    friend class ChunkedIntervalMap;
+    const ChunkedIntervalMap *map;
+    size_t chunk, index;
+  };
+
+  [[nodiscard]] const_iterator begin() const { return {this, 0, 0}; }
+  [[nodiscard]] const_iterator end() const { return {this, chunks.size(), 0}; }
+  [[nodiscard]] size_t size() const { return count; }
+  [[nodiscard]] bool empty() const { return count == 0; }
+
+  // [lowerBound(), upperBound()) covers every tracked range, anything outside cannot be in the map
+  [[nodiscard]] uintptr_t lowerBound() const { return lo; }
+  [[nodiscard]] uintptr_t upperBound() const { return hi; }
+  [[nodiscard]] bool outside(uintptr_t ptr) const { return ptr < lo || ptr >= hi; }
+
+  // Inserts [base, base + size), fails if the range overlaps an existing entry.
+  bool emplace(uintptr_t base, size_t size, V value) {
+    if (chunks.empty()) {
+      chunks.push_back(std::make_shared<const Chunk>(1, Entry{base, size, std::move(value)}));
+      firstBases.push_back(base);
+      count++;
+      updateBounds();
+      return true;
+    }
+    auto c = chunkFor(base);
+    const auto &chunk = *chunks[c];
+    auto at = std::lower_bound(chunk.begin(), chunk.end(), base, [](const Entry &e, uintptr_t b) { return e.base < b; });
+    auto position = size_t(at - chunk.begin());
+    // the neighbours are in this chunk, apart from the next one when inserting at the end, which starts the next chunk
+    const Entry *next = at != chunk.end() ? &*at : c + 1 < chunks.size() ? &chunks[c + 1]->front() : nullptr;
+    const Entry *prev = at != chunk.begin() ? &*std::prev(at) : nullptr;
+    if ((next && next->base < base + size) || (prev && prev->end() > base)) return false;
+    updateChunk(c, [&](Chunk &copy) { copy.insert(copy.begin() + position, Entry{base, size, std::move(value)}); });
+    count++;
+    return true;
+  }
+
+  // Finds the entry that starts exactly at base.
+  [[nodiscard]] const_iterator find(uintptr_t base) const {
+    if (outside(base)) return end();
+    auto c = chunkFor(base);
+    const auto &chunk = *chunks[c];
+    auto at = std::lower_bound(chunk.begin(), chunk.end(), base, [](const Entry &e, uintptr_t b) { return e.base < b; });
+    return at != chunk.end() && at->base == base ? const_iterator{this, c, size_t(at - chunk.begin())} : end();
+  }
+
+  // Finds the entry whose range contains ptr.
+  [[nodiscard]] const_iterator findContaining(uintptr_t ptr) const {
+    if (outside(ptr)) return end();
+    auto c = chunkFor(ptr);
+    const auto &chunk = *chunks[c];
+    auto at = std::upper_bound(chunk.begin(), chunk.end(), ptr, [](uintptr_t p, const Entry &e) { return p < e.base; });
+    if (at == chunk.begin()) return end();
+    --at;
+    return at->contains(ptr) ? const_iterator{this, c, size_t(at - chunk.begin())} : end();
+  }
+
+  void erase(const_iterator it) {
+    updateChunk(it.chunk, [&](Chunk &copy) { copy.erase(copy.begin() + it.index); });
+    count--;
+  }
+};
+
+} // namespace utpx
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "offset_learner.h"
+#include "utpx.h"
+
+namespace utpx {
+
+OffsetLearner::OffsetLearner(size_t learnScans, size_t rescanInterval) : learnScans(learnScans), rescanInterval(rescanInterval) {}
+
+OffsetLearner::Layout *OffsetLearner::find(const std::string &kernel, size_t index, size_t argSize) {
+  if (learnScans == 0) return nullptr;
+  auto [it, inserted] =
+      layouts.try_emplace(Key{kernel, index}, Layout{.argSize = argSize, .offsets = {}, .scans = 0, .sinceScan = 0, .learned = false});
+  return it->second.argSize == argSize ? &it->second : nullptr;
+}
+
+bool OffsetLearner::probeOnly(Layout &layout) const {
+  if (!layout.learned) return false;
+  if (rescanInterval != 0 && ++layout.sinceScan >= rescanInterval) {
+    layout.sinceScan = 0;
+    return false;
+  }
+  return true;
+}
+
+void OffsetLearner::recordScan(Layout &layout, const std::vector<size_t> &offsets) const {
+  // Offsets are only ever added: one that a scan didn't find a pointer at may just hold a null pointer this time.
+  std::vector<size_t> merged;
+  std::set_union(layout.offsets.begin(), layout.offsets.end(), offsets.begin(), offsets.end(), std::back_inserter(merged));
+  layout.offsets = std::move(merged);
+  layout.sinceScan = 0;
+  if (++layout.scans >= learnScans) layout.learned = true;
+}
+
+bool OffsetLearner::load(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) return false;
+  size_t loaded = 0;
+  for (std::string line; std::getline(file, line);) {
+    if (line.empty() || line[0] == '#') continue;
+    std::istringstream fields(line);
+    Key key;
+    Layout layout{.argSize = 0, .offsets = {}, .scans = learnScans, .sinceScan = 0, .learned = true};
+    if (!(fields >> key.kernel >> key.index >> layout.argSize)) {
+      log("[LEARN] Ignoring malformed line in %s: %s", path.c_str(), line.c_str());
+      continue;
+    }
+    for (size_t offset; fields >> offset;)
+      if (offset + sizeof(uintptr_t) <= layout.argSize) layout.offsets.push_back(offset);
+    std::sort(layout.offsets.begin(), layout.offsets.end());
+    layouts.insert_or_assign(std::move(key), std::move(layout));
+    loaded++;
+  }
+  log("[LEARN] Loaded %zu argument layouts from %s", loaded, path.c_str());
+  return true;
+}
+
+bool OffsetLearner::save(const std::string &path) const {
+  size_t saved = 0;
+  if (!writeFileAtomically(path, [&](std::FILE *file) {
+        std::fprintf(file, "# UTPX learned pointer offsets: kernel argument-index argument-size offsets...\n");
+        for (const auto &[key, layout] : layouts) {
+          if (!layout.learned) continue;
+          std::fprintf(file, "%s %zu %zu", key.kernel.c_str(), key.index, layout.argSize);
+          for (auto offset : layout.offsets)
+            std::fprintf(file, " %zu", offset);
+          std::fprintf(file, "\n");
+          saved++;
+        }
+        return true;
+      }))
+    return false;
+  log("[LEARN] Saved %zu argument layouts to %s", saved, path.c_str());
+  return true;
+}
+
+} // namespace utpx
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace utpx {
+
+// Learns where by-value struct arguments, such as StdPar lambda captures, hold their pointers. The offsets pointers were found at in the
+// first learnScans full scans of an argument are kept, and later launches probe only those. Every rescanInterval-th launch (0 never) scans
+// the whole argument again in case the layout changed, and so does a launch where a learned offset doesn't hold a tracked pointer.
+// Layouts are keyed by mangled kernel name and argument index so that they can be saved and loaded by a later run, which then skips the
+// learning. Not thread-safe apart from enabled(), callers serialise access. See UTPX_LEARN_OFFSETS.
+class OffsetLearner {
+public:
+  struct Layout {
+    size_t argSize;
+    std::vector<size_t> offsets; // ascending
+    size_t scans;                // full scans recorded so far
+    size_t sinceScan;            // launches since the last full scan once learned
+    bool learned;
+  };
+
+  OffsetLearner(size_t learnScans, size_t rescanInterval);
+
+  // Whether learning is on at all, fixed at construction so that callers may check it without serialising.
+  [[nodiscard]] bool enabled() const { return learnScans != 0; }
+
+  // Returns the layout of an argument, created on first use. Returns nullptr if learning is disabled, or if a loaded layout was learned
+  // for an argument of another size, in which case the kernel has changed since and the argument is always scanned in full.
+  [[nodiscard]] Layout *find(const std::string &kernel, size_t index, size_t argSize);
+  // Whether this launch should only probe the learned offsets of layout rather than scan the whole argument.
+  [[nodiscard]] bool probeOnly(Layout &layout) const;
+  // Records the offsets a full scan of the argument found pointers at.
+  void recordScan(Layout &layout, const std::vector<size_t> &offsets) const;
+
+  // One line per learned argument: kernel name, argument index, argument size, then the offsets.
+  bool load(const std::string &path);
+  bool save(const std::string &path) const;
+
+private:
+  struct Key {
+    std::string kernel;
+    size_t index;
+    bool operator==(const Key &that) const { return index == that.index && kernel == that.kernel; }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &key) const { return std::hash<std::string>{}(key.kernel) ^ std::hash<size_t>{}(key.index); }
+  };
+
+  size_t learnScans;
+  size_t rescanInterval;
+  std::unordered_map<Key, Layout, KeyHash> layouts;
+};
+
+} // namespace utpx
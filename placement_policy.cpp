@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "placement_policy.h"
+#include "stats.h"
+#include "utpx.h"
+
+namespace utpx {
+
+static stats::Counter toMirror("policy.to_mirror");
+static stats::Counter toResident("policy.to_resident");
+static stats::Counter toStreamed("policy.to_streamed");
+static stats::Counter toMapped("policy.to_mapped");
+
+static int64_t steadyNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char *placementName(Placement placement) {
+  switch (placement) {
+    case Placement::Mirror: return "mirror";
+    case Placement::Resident: return "resident";
+    case Placement::Streamed: return "streamed";
+    case Placement::Mapped: return "mapped";
+  }
+  return "?";
+}
+
+void AccessHistory::reset() {
+  placement = Placement::Mirror;
+  launches = 0;
+  touchedLaunches = 0;
+  hostFaults = 0;
+  migratedBytes = 0;
+  lastHostTouch = steadyNanos(); // the host wrote it before the first launch, idle counts from here
+  savedPerLaunch = 0;
+  windowTouched = 0;
+  windowMigrated = 0;
+  candidate = Placement::Mirror;
+  agreeing = 0;
+}
+
+PlacementPolicy::PlacementPolicy(size_t window, size_t hysteresis, std::chrono::nanoseconds idle, size_t mappedLimit, size_t mappedPercent,
+                                 bool verbose)
+    : window(window), hysteresis(std::max<size_t>(hysteresis, 1)), idle(idle), mappedLimit(mappedLimit), mappedPercent(mappedPercent),
+      verbose(verbose) {}
+
+void PlacementPolicy::launched(AccessHistory &history, bool touched, const void *base, size_t size) const {
+  if (window == 0 || history.placement.load(std::memory_order_relaxed) == Placement::Mapped) return;
+  if (touched) {
+    history.lastHostTouch.store(steadyNanos(), std::memory_order_relaxed);
+    history.touchedLaunches.fetch_add(1, std::memory_order_relaxed);
+    history.windowTouched.fetch_add(1, std::memory_order_relaxed);
+  }
+  // exactly one launch closes each window, concurrent launches of the allocation only count towards it
+  auto launches = history.launches.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (launches % window != 0) return;
+  auto windowTouched = history.windowTouched.exchange(0, std::memory_order_relaxed);
+  auto migrated = history.migratedBytes.load(std::memory_order_relaxed);
+  auto windowMigrated = migrated - history.windowMigrated.exchange(migrated, std::memory_order_relaxed);
+  auto idleFor = std::chrono::nanoseconds(steadyNanos() - history.lastHostTouch.load(std::memory_order_relaxed));
+  auto suggested = Placement::Mirror;
+  if (mappedLimit != 0 && size <= mappedLimit && windowTouched * 100 >= window * mappedPercent) suggested = Placement::Mapped;
+  else if (windowTouched * 4 >= window * 3)
+    suggested = Placement::Streamed;
+  else if (windowTouched == 0 && idleFor >= idle)
+    suggested = Placement::Resident;
+
+  auto current = history.placement.load(std::memory_order_relaxed);
+  if (suggested == current) {
+    history.agreeing.store(0, std::memory_order_relaxed);
+    return;
+  }
+  if (history.candidate.exchange(suggested, std::memory_order_relaxed) != suggested) history.agreeing.store(0, std::memory_order_relaxed);
+  if (history.agreeing.fetch_add(1, std::memory_order_relaxed) + 1 < hysteresis) return;
+  history.agreeing.store(0, std::memory_order_relaxed);
+  // the launches of the last window paid for its migrations, a mapped one pays for none
+  history.savedPerLaunch.store(windowMigrated / window, std::memory_order_relaxed);
+  history.placement.store(suggested, std::memory_order_relaxed);
+  switch (suggested) {
+    case Placement::Mirror: ++toMirror; break;
+    case Placement::Resident: ++toResident; break;
+    case Placement::Streamed: ++toStreamed; break;
+    case Placement::Mapped: ++toMapped; break;
+  }
+
+  auto idleMillis = std::chrono::duration<double, std::milli>(idleFor).count();
+  if (verbose)
+    std::fprintf(stderr, "[UTPX][POLICY] %p (%zu bytes): %s -> %s after %lu launches, %lu touched, %lu host faults, %lu bytes migrated, "
+                         "host idle for %.1f ms\n",
+                 base, size, placementName(current), placementName(suggested), launches, history.touchedLaunches.load(),
+                 history.hostFaults.load(), history.migratedBytes.load(), idleMillis);
+  else
+    log("[POLICY] %p (%zu bytes): %s -> %s after %lu launches, %lu touched, %lu host faults, %lu bytes migrated, host idle for %.1f ms",
+        base, size, placementName(current), placementName(suggested), launches, history.touchedLaunches.load(), history.hostFaults.load(),
+        history.migratedBytes.load(), idleMillis);
+}
+
+} // namespace utpx
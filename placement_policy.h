@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace utpx {
+
+// How a mirrored allocation is handled between launches, chosen per allocation by PlacementPolicy.
+enum class Placement : uint8_t {
+  Mirror,   // written back speculatively after a launch only if the host touched it after the previous one, otherwise on fault
+  Resident, // the host has left it alone for a while: never written back speculatively, and evicted only once nothing else is left
+  Streamed, // the host touches it after nearly every launch: written back speculatively after every launch, like a prefetch to the host
+  Mapped,   // small and touched by the host after every launch: pinned host memory that kernels access in place, for good
+};
+
+[[nodiscard]] const char *placementName(Placement placement);
+
+// What the policy has seen of one allocation. Written by launching threads and fault handlers without a lock, the counters only steer
+// heuristics so they are all relaxed.
+struct AccessHistory {
+  std::atomic<Placement> placement{Placement::Mirror};
+  std::atomic_uint64_t launches{};
+  std::atomic_uint64_t touchedLaunches{}; // launches the host touched the allocation before
+  std::atomic_uint64_t hostFaults{};
+  std::atomic_uint64_t migratedBytes{};  // uploaded, written back and copied between devices
+  std::atomic_int64_t lastHostTouch{};   // steady clock nanoseconds, as seen by the next launch
+  std::atomic_uint64_t savedPerLaunch{}; // estimated bytes each launch no longer migrates once Mapped
+  // The window being evaluated, see PlacementPolicy::launched.
+  std::atomic_uint64_t windowTouched{};
+  std::atomic_uint64_t windowMigrated{}; // migratedBytes when the window started
+  std::atomic<Placement> candidate{Placement::Mirror};
+  std::atomic_uint32_t agreeing{}; // windows in a row that suggested candidate
+
+  // Starts over for a new allocation. The allocation must not be reachable by other threads.
+  void reset();
+  void faulted(size_t bytes) {
+    hostFaults.fetch_add(1, std::memory_order_relaxed);
+    migratedBytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  void migrated(size_t bytes) { migratedBytes.fetch_add(bytes, std::memory_order_relaxed); }
+};
+
+// Moves allocations between placements from their access history, deciding once every window launches of an allocation. A window in which
+// the host touched an allocation of at most mappedLimit bytes before at least mappedPercent of the launches suggests Mapped, one in which
+// it touched any allocation before at least three quarters of them Streamed, one in which it never did and hasn't for idle Resident, and
+// any other one Mirror. The placement only changes once hysteresis windows in a row suggested the same other one, so an allocation on the
+// edge of a threshold doesn't flip every window. Mapped is never left again, the caller converts the allocation on its next launch and
+// puts it back to Mirror if that fails. Decisions are logged, and printed to stderr in release builds too if verbose. Thread-safe. See
+// UTPX_POLICY_WINDOW.
+class PlacementPolicy {
+public:
+  PlacementPolicy(size_t window, size_t hysteresis, std::chrono::nanoseconds idle, size_t mappedLimit, size_t mappedPercent, bool verbose);
+
+  // Whether allocations ever leave Mirror, fixed at construction.
+  [[nodiscard]] bool enabled() const { return window != 0; }
+  // Records a launch using the allocation at base, after which its placement may have changed. touched says whether the host touched the
+  // allocation since its previous launch.
+  void launched(AccessHistory &history, bool touched, const void *base, size_t size) const;
+
+private:
+  size_t window;
+  size_t hysteresis;
+  std::chrono::nanoseconds idle;
+  size_t mappedLimit;
+  size_t mappedPercent;
+  bool verbose;
+};
+
+} // namespace utpx
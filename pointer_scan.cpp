@@ -0,0 +1,67 @@
+#include <cstring>
+
+#ifdef __AVX2__
+  #include <immintrin.h>
+#endif
+
+#include "pointer_scan.h"
+
+namespace utpx {
+
+void scanPointerCandidatesScalar(const char *data, size_t size, size_t stride, uintptr_t lo, uintptr_t hi,
+                                 std::vector<size_t> &candidates) {
+  candidates.clear();
+  for (size_t offset = 0; offset + sizeof(uintptr_t) <= size; offset += stride) {
+    uintptr_t value;
+    std::memcpy(&value, data + offset, sizeof(uintptr_t));
+    if (value >= lo && value < hi) candidates.push_back(offset);
+  }
+}
+
+#ifdef __AVX2__
+
+// Bit k of a 4 lane mask moved to bit 8 * k, the byte offset of lane k within a 32 byte load.
+static constexpr uint32_t spreadLanes[16] = {
+    0x00000000, 0x00000001, 0x00000100, 0x00000101, 0x00010000, 0x00010001, 0x00010100, 0x00010101,
+    0x01000000, 0x01000001, 0x01000100, 0x01000101, 0x01010000, 0x01010001, 0x01010100, 0x01010101,
+};
+
+void scanPointerCandidates(const char *data, size_t size, size_t stride, uintptr_t lo, uintptr_t hi, std::vector<size_t> &candidates) {
+  if (stride == 0 || sizeof(uintptr_t) % stride != 0 || lo >= hi) {
+    scanPointerCandidatesScalar(data, size, stride, lo, hi, candidates);
+    return;
+  }
+  candidates.clear();
+  // value in [lo, hi) is value - lo < hi - lo unsigned; AVX2 only compares signed, so both sides are offset by the sign bit
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i base = _mm256_set1_epi64x(int64_t(lo));
+  const __m256i range = _mm256_xor_si256(_mm256_set1_epi64x(int64_t(hi - lo)), sign);
+  // Each block covers the windows at the next 32 offsets: the load at block + shift holds the ones at shift, shift + 8, shift + 16 and
+  // shift + 24. The last load of a block reads up to block + 32 + (8 - stride) bytes.
+  size_t block = 0;
+  for (; block + 32 + sizeof(uintptr_t) - stride <= size; block += 32) {
+    uint32_t mask = 0;
+    for (size_t shift = 0; shift < sizeof(uintptr_t); shift += stride) {
+      auto words = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + block + shift));
+      auto inside = _mm256_cmpgt_epi64(range, _mm256_xor_si256(_mm256_sub_epi64(words, base), sign));
+      mask |= spreadLanes[_mm256_movemask_pd(_mm256_castsi256_pd(inside))] << shift;
+    }
+    for (; mask != 0; mask &= mask - 1)
+      candidates.push_back(block + __builtin_ctz(mask));
+  }
+  for (size_t offset = block; offset + sizeof(uintptr_t) <= size; offset += stride) {
+    uintptr_t value;
+    std::memcpy(&value, data + offset, sizeof(uintptr_t));
+    if (value >= lo && value < hi) candidates.push_back(offset);
+  }
+}
+
+#else
+
+void scanPointerCandidates(const char *data, size_t size, size_t stride, uintptr_t lo, uintptr_t hi, std::vector<size_t> &candidates) {
+  scanPointerCandidatesScalar(data, size, stride, lo, hi, candidates);
+}
+
+#endif
+
+} // namespace utpx
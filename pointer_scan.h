@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace utpx {
+
+// Finds the pointer-sized windows of a by-value kernel argument that may hold a pointer into tracked memory, so that only those go through
+// the exact allocation lookup. Replaces the contents of candidates with the byte offsets o, in increasing order, with o % stride == 0 and
+// o + sizeof(uintptr_t) <= size whose unaligned uintptr_t value lies in [lo, hi).
+// Uses AVX2 when the library is built for a CPU that has it (we build with -march=native), otherwise the scalar loop below.
+void scanPointerCandidates(const char *data, size_t size, size_t stride, uintptr_t lo, uintptr_t hi, std::vector<size_t> &candidates);
+
+// The scalar loop, always available so that the vectorised scan can be checked against it.
+void scanPointerCandidatesScalar(const char *data, size_t size, size_t stride, uintptr_t lo, uintptr_t hi,
+                                 std::vector<size_t> &candidates);
+
+} // namespace utpx
@@ -0,0 +1,69 @@
+#include <algorithm>
+
+#include "slab_allocator.h"
+#include "stats.h"
+#include "utpx.h"
+
+namespace utpx {
+
+static stats::Counter slabsMapped("slab.mapped");
+static stats::Counter slabsUnmapped("slab.unmapped");
+
+SlabAllocator::SlabAllocator(size_t slabSize, size_t maxSlotSize) : slabSize(slabSize), maxSlotSize(std::min(maxSlotSize, slabSize)) {}
+
+bool SlabAllocator::packs(size_t size) const { return size != 0 && size <= maxSlotSize; }
+
+size_t SlabAllocator::slotSize(size_t size) const {
+  if (size <= minSlotSize) return minSlotSize;
+  return size_t(1) << (64 - __builtin_clzll(size - 1));
+}
+
+void *SlabAllocator::allocate(size_t size, const std::function<void *(size_t)> &mapSlab) {
+  auto slot = slotSize(size);
+  auto &candidates = available[slot];
+  if (candidates.empty()) {
+    auto base = mapSlab(slabSize);
+    if (!base) return nullptr;
+    auto slots = uint32_t(slabSize / slot);
+    Slab slab{.slotSize = slot, .free = std::vector<uint32_t>(slots), .used = std::vector<bool>(slots)};
+    for (uint32_t i = 0; i < slots; ++i)
+      slab.free[i] = slots - 1 - i;
+    slabs.emplace(reinterpret_cast<uintptr_t>(base), std::move(slab));
+    candidates.insert(reinterpret_cast<uintptr_t>(base));
+    slabCount[slot]++;
+    ++slabsMapped;
+    log("[SLAB] Mapped slab %p for %zu byte slots", base, slot);
+  }
+  auto base = *candidates.begin();
+  auto &slab = slabs.at(base);
+  auto index = slab.free.back();
+  slab.free.pop_back();
+  slab.used[index] = true;
+  if (slab.free.empty()) candidates.erase(candidates.begin());
+  return reinterpret_cast<void *>(base + index * slot);
+}
+
+std::optional<void *> SlabAllocator::release(void *ptr) {
+  auto address = reinterpret_cast<uintptr_t>(ptr);
+  auto it = slabs.upper_bound(address);
+  if (it == slabs.begin()) return {};
+  --it;
+  auto base = it->first;
+  auto &slab = it->second;
+  if (address >= base + slabSize || (address - base) % slab.slotSize != 0) return {};
+  auto index = uint32_t((address - base) / slab.slotSize);
+  if (!slab.used[index]) return {};
+  slab.used[index] = false;
+  slab.free.push_back(index);
+  auto &candidates = available[slab.slotSize];
+  candidates.insert(base);
+  if (slab.free.size() != slab.used.size() || slabCount[slab.slotSize] == 1) return nullptr;
+  log("[SLAB] Unmapping empty slab %p", reinterpret_cast<void *>(base));
+  candidates.erase(base);
+  slabCount[slab.slotSize]--;
+  slabs.erase(it);
+  ++slabsUnmapped;
+  return reinterpret_cast<void *>(base);
+}
+
+} // namespace utpx
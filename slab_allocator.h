@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <vector>
+
+namespace utpx {
+
+// Packs allocations smaller than a page into slabs of slabSize bytes, so that they can be mirrored and protected a slab at a time instead
+// of being left host-resident. Each slab holds slots of a single power of two size class, at least minSlotSize so that slots keep the
+// alignment hipMalloc guarantees. Not thread-safe, callers serialise access. See UTPX_SLAB_SIZE.
+class SlabAllocator {
+public:
+  static constexpr size_t minSlotSize = 256;
+
+  SlabAllocator(size_t slabSize, size_t maxSlotSize);
+
+  // Whether an allocation of size bytes is packed into a slab, always false if slabs are disabled with a slabSize of 0.
+  [[nodiscard]] bool packs(size_t size) const;
+  // Returns a free slot for size bytes. If every slab of its class is full, mapSlab(slabSize) is called for a new page-aligned slab.
+  // Returns nullptr if that fails.
+  [[nodiscard]] void *allocate(size_t size, const std::function<void *(size_t)> &mapSlab);
+  // Frees the slot at ptr. Returns the base of its slab if that is now empty and should be unmapped, nullptr if it stays, or nothing if ptr
+  // is not a slot. The last slab of each class is kept even when empty, so that an allocation freed and made again every iteration doesn't
+  // map and mirror a new slab each time.
+  [[nodiscard]] std::optional<void *> release(void *ptr);
+
+private:
+  struct Slab {
+    size_t slotSize;
+    std::vector<uint32_t> free; // slot indices, taken from the back
+    std::vector<bool> used;
+  };
+
+  [[nodiscard]] size_t slotSize(size_t size) const;
+
+  size_t slabSize;
+  size_t maxSlotSize;
+  std::map<uintptr_t, Slab> slabs;                 // by base
+  std::map<size_t, std::set<uintptr_t>> available; // slabs with a free slot by slot size, lowest address first
+  std::map<size_t, size_t> slabCount;              // slabs by slot size
+};
+
+} // namespace utpx
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cstring>
+
+#include "staging_ring.h"
+#include "stats.h"
+#include "utpx.h"
+
+namespace utpx {
+
+static stats::Counter stagedBytes("staging.bytes");
+static stats::Counter unstagedBytes("staging.unstaged.bytes");
+
+StagingRing::StagingRing(const Api &api, size_t count, size_t chunkSize)
+    : api(api), count(std::max<size_t>(count, 1)), chunkSize(chunkSize), available(chunkSize != 0) {
+  slots.reserve(this->count); // drain reads slots without the lock, so they must never move
+}
+
+bool StagingRing::mapLocked() {
+  if (!available || slots.size() == count) return available;
+  while (slots.size() < count) {
+    Slot slot{};
+    if (auto result = api.hostMalloc(reinterpret_cast<void **>(&slot.buffer), chunkSize, 0); result != hipSuccess) {
+      log("[STAGING] hipHostMalloc(%zu) failed with %d, copying without staging", chunkSize, result);
+      return available = false;
+    }
+    if (auto result = api.eventCreate(&slot.done, hipEventDisableTiming); result != hipSuccess) {
+      log("[STAGING] hipEventCreateWithFlags failed with %d, copying without staging", result);
+      return available = false;
+    }
+    slots.push_back(slot);
+  }
+  for (auto &slot : slots)
+    idle.push_back(&slot);
+  log("[STAGING] Mapped %zu staging buffers of %zu bytes", count, chunkSize);
+  return true;
+}
+
+StagingRing::Claim::Claim(StagingRing &ring, size_t chunks) : ring(ring) {
+  std::unique_lock<std::mutex> guard(ring.lock);
+  ring.returned.wait(guard, [&]() { return !ring.idle.empty(); });
+  while (slots.size() < chunks && !ring.idle.empty()) {
+    slots.push_back(ring.idle.front());
+    ring.idle.pop_front();
+  }
+}
+
+StagingRing::Claim::~Claim() {
+  {
+    std::lock_guard<std::mutex> guard(ring.lock);
+    ring.idle.insert(ring.idle.end(), slots.begin(), slots.end());
+  }
+  ring.returned.notify_all();
+}
+
+hipError_t StagingRing::upload(void *dst, const void *src, size_t length, hipStream_t stream) {
+  bool mapped;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    mapped = mapLocked();
+  }
+  if (!mapped) {
+    unstagedBytes.add(length);
+    return api.memcpy(dst, src, length, hipMemcpyHostToDevice);
+  }
+  Claim claim(*this, (length + chunkSize - 1) / chunkSize);
+  for (size_t done = 0, chunk = 0; done < length; done += chunkSize, ++chunk) {
+    auto &slot = claim[chunk];
+    size_t chunkLength = std::min(chunkSize, length - done);
+    if (auto result = api.eventSynchronize(slot.done); result != hipSuccess) return result;
+    std::memcpy(slot.buffer, static_cast<const char *>(src) + done, chunkLength);
+    if (auto result = api.memcpyAsync(static_cast<char *>(dst) + done, slot.buffer, chunkLength, hipMemcpyHostToDevice, stream);
+        result != hipSuccess)
+      return result;
+    if (auto result = api.eventRecord(slot.done, stream); result != hipSuccess) return result;
+  }
+  stagedBytes.add(length);
+  return hipSuccess;
+}
+
+hipError_t StagingRing::download(void *dst, const void *src, size_t length, hipStream_t stream) {
+  bool mapped;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    mapped = mapLocked();
+  }
+  if (!mapped) {
+    unstagedBytes.add(length);
+    return api.memcpy(dst, src, length, hipMemcpyDeviceToHost);
+  }
+  // keep every claimed buffer busy with a DMA while the oldest completed chunk is copied out
+  size_t chunks = (length + chunkSize - 1) / chunkSize, issued = 0;
+  Claim claim(*this, chunks);
+  for (size_t copied = 0; copied < chunks; ++copied) {
+    for (; issued < chunks && issued - copied < claim.size(); ++issued) {
+      auto &slot = claim[issued];
+      size_t offset = issued * chunkSize;
+      if (auto result = api.eventSynchronize(slot.done); result != hipSuccess) return result; // may still be draining an upload
+      if (auto result = api.memcpyAsync(slot.buffer, static_cast<const char *>(src) + offset, std::min(chunkSize, length - offset),
+                                        hipMemcpyDeviceToHost, stream);
+          result != hipSuccess)
+        return result;
+      if (auto result = api.eventRecord(slot.done, stream); result != hipSuccess) return result;
+    }
+    auto &slot = claim[copied];
+    size_t offset = copied * chunkSize;
+    if (auto result = api.eventSynchronize(slot.done); result != hipSuccess) return result;
+    std::memcpy(static_cast<char *>(dst) + offset, slot.buffer, std::min(chunkSize, length - offset));
+  }
+  stagedBytes.add(length);
+  return hipSuccess;
+}
+
+hipError_t StagingRing::drain() {
+  size_t mapped;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    mapped = slots.size();
+  }
+  for (size_t i = 0; i < mapped; ++i)
+    if (auto result = api.eventSynchronize(slots[i].done); result != hipSuccess) return result;
+  return hipSuccess;
+}
+
+} // namespace utpx
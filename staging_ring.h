@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "hipew.h"
+
+namespace utpx {
+
+// Copies between pageable host memory and the device through a ring of pinned bounce buffers, so that the runtime doesn't stage them
+// itself. Transfers are split into chunks of chunkSize, and copying one chunk to or from pageable memory overlaps the DMA of the others.
+// If pinned memory is unavailable, or chunkSize is 0, every transfer is a plain hipMemcpy instead.
+// Each transfer claims as many free buffers as it has chunks, or at least one, and copies through those alone, so transfers from several
+// threads, such as the fault handlers', proceed side by side while the ring lock is only held to claim and return buffers.
+// See UTPX_STAGING_BUFFERS and UTPX_STAGING_CHUNK_SIZE.
+class StagingRing {
+public:
+  // The HIP functions the ring copies with, so that it can run against a stub.
+  struct Api {
+    _hipHostMalloc hostMalloc;
+    _hipMemcpy memcpy;
+    _hipMemcpyAsync memcpyAsync;
+    _hipEventCreateWithFlags eventCreate;
+    _hipEventRecord eventRecord;
+    _hipEventSynchronize eventSynchronize;
+  };
+
+  StagingRing(const Api &api, size_t count, size_t chunkSize);
+
+  // Copies length bytes from host src to device dst, ordered before later work on stream. Returns once src has been read in full, the
+  // copy itself may still be in flight.
+  [[nodiscard]] hipError_t upload(void *dst, const void *src, size_t length, hipStream_t stream);
+  // Copies length bytes from device src to host dst, ordered after earlier work on stream. Returns once dst has been written in full.
+  [[nodiscard]] hipError_t download(void *dst, const void *src, size_t length, hipStream_t stream);
+  // Waits for every copy queued by upload to complete.
+  [[nodiscard]] hipError_t drain();
+
+private:
+  struct Slot {
+    char *buffer;
+    hipEvent_t done; // recorded after the last DMA in or out of buffer
+  };
+
+  // The slots one transfer copies through, returned to the ring when it goes out of scope. Chunk i uses slot i modulo size().
+  class Claim {
+  public:
+    Claim(StagingRing &ring, size_t chunks);
+    ~Claim();
+    Claim(const Claim &) = delete;
+    Claim &operator=(const Claim &) = delete;
+    [[nodiscard]] Slot &operator[](size_t chunk) const { return *slots[chunk % slots.size()]; }
+    [[nodiscard]] size_t size() const { return slots.size(); }
+
+  private:
+    StagingRing &ring;
+    std::vector<Slot *> slots;
+  };
+
+  bool mapLocked();
+
+  Api api;
+  size_t count;
+  size_t chunkSize;
+  std::mutex lock; // guards idle, available and the allocation of slots
+  std::condition_variable returned;
+  std::vector<Slot> slots; // allocated on first use, HIP may not be initialised yet when we are loaded, then never changes
+  std::deque<Slot *> idle; // least recently returned first, as its last DMA is the most likely to have completed
+  bool available;
+};
+
+} // namespace utpx
@@ -0,0 +1,24 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "stats.h"
+
+namespace utpx::stats {
+
+// Counters are globals in other translation units that may be destroyed before our destructor runs, so keep the registry trivially
+// destructible.
+static constexpr size_t MaxCounters = 64;
+static Counter *counters[MaxCounters]{};
+static std::atomic_size_t counterCount{};
+
+Counter::Counter(const char *name) : name(name) {
+  if (auto i = counterCount.fetch_add(1); i < MaxCounters) counters[i] = this;
+}
+
+void dump() {
+  for (size_t i = 0; i < std::min(counterCount.load(), MaxCounters); ++i) {
+    std::fprintf(stderr, "[UTPX][STATS] %-40s %lu\n", counters[i]->name, counters[i]->load());
+  }
+}
+
+} // namespace utpx::stats
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace utpx::stats {
+
+// A named monotonic counter, counters register themselves on construction and are printed by dump().
+// Define them as globals next to the code that bumps them.
+struct Counter {
+  const char *name;
+  std::atomic_uint64_t value{};
+
+  explicit Counter(const char *name);
+  void add(uint64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+  Counter &operator++() {
+    add(1);
+    return *this;
+  }
+  [[nodiscard]] uint64_t load() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Prints every counter to stderr, this is not tied to the debug log so that it also works in release builds.
+void dump();
+
+} // namespace utpx::stats
@@ -0,0 +1,100 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "userfaultfd.h"
+#include "utpx.h"
+
+namespace utpx::fault::uffd {
+
+static int uffd = -1;
+static bool uffdWriteProtect{};
+
+static int openWithFeatures(uint64_t features) {
+  int fd = static_cast<int>(syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK));
+#ifdef UFFD_USER_MODE_ONLY
+  // Without CAP_SYS_PTRACE (or vm.unprivileged_userfaultfd=1) we can still handle faults from userspace, but faults raised while the
+  // kernel accesses our pages on our behalf (e.g. read(2) into a mirrored buffer) will fail with EFAULT instead.
+  if (fd == -1 && errno == EPERM) fd = static_cast<int>(syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY));
+#endif
+  if (fd == -1) {
+    log("[UFFD] userfaultfd unavailable: %s", strerror(errno));
+    return -1;
+  }
+  uffdio_api api{.api = UFFD_API, .features = features, .ioctls = 0};
+  if (ioctl(fd, UFFDIO_API, &api) == -1) {
+    log("[UFFD] UFFDIO_API(features=0x%lx) failed: %s", (unsigned long)features, strerror(errno));
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool open(bool &writeProtect) {
+  // UFFDIO_API can only be negotiated once per descriptor, so falling back to missing-page mode needs a new one.
+  if ((uffd = openWithFeatures(UFFD_FEATURE_PAGEFAULT_FLAG_WP)) != -1) uffdWriteProtect = true;
+  else if ((uffd = openWithFeatures(0)) != -1)
+    uffdWriteProtect = false;
+  else
+    return false;
+  writeProtect = uffdWriteProtect;
+  log("[UFFD] userfaultfd=%d opened, write-protect=%d", uffd, uffdWriteProtect);
+  return true;
+}
+
+void close() {
+  if (uffd != -1) ::close(uffd);
+  uffd = -1;
+}
+
+int fd() { return uffd; }
+
+void registerRange(void *addr, size_t length) {
+  uffdio_register reg{.range = {.start = reinterpret_cast<uintptr_t>(addr), .len = length},
+                      .mode = UFFDIO_REGISTER_MODE_MISSING | (uffdWriteProtect ? UFFDIO_REGISTER_MODE_WP : 0),
+                      .ioctls = 0};
+  if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) fatal("[UFFD] UFFDIO_REGISTER(%p, %ld) failed: %s", addr, length, strerror(errno));
+}
+
+void unregisterRange(void *addr, size_t length) {
+  uffdio_range range{.start = reinterpret_cast<uintptr_t>(addr), .len = length};
+  if (ioctl(uffd, UFFDIO_UNREGISTER, &range) == -1) fatal("[UFFD] UFFDIO_UNREGISTER(%p, %ld) failed: %s", addr, length, strerror(errno));
+}
+
+void copy(void *dst, const void *src, size_t length, bool writeProtect) {
+  static const size_t pageSize = sysconf(_SC_PAGE_SIZE);
+  size_t done = 0;
+  while (done < length) {
+    uffdio_copy op{.dst = reinterpret_cast<uintptr_t>(dst) + done,
+                   .src = reinterpret_cast<uintptr_t>(src) + done,
+                   .len = length - done,
+                   .mode = UFFDIO_COPY_MODE_DONTWAKE | (writeProtect ? UFFDIO_COPY_MODE_WP : 0),
+                   .copy = 0};
+    if (ioctl(uffd, UFFDIO_COPY, &op) == 0) return;
+    if (op.copy > 0) done += op.copy;       // partially copied, carry on from there
+    else if (errno == EEXIST) done += pageSize; // already populated by a racing resolution, keep what's there
+    else if (errno != EAGAIN)
+      fatal("[UFFD] UFFDIO_COPY(%p <- %p, %ld) failed: %s", static_cast<char *>(dst) + done, static_cast<const char *>(src) + done,
+            length - done, strerror(errno));
+  }
+}
+
+void writeProtect(void *addr, size_t length, bool enable) {
+  uffdio_writeprotect op{.range = {.start = reinterpret_cast<uintptr_t>(addr), .len = length},
+                         // the kernel only takes DONTWAKE when clearing write-protection, there's nobody to wake when setting it anyway
+                         .mode = enable ? UFFDIO_WRITEPROTECT_MODE_WP : UFFDIO_WRITEPROTECT_MODE_DONTWAKE};
+  if (ioctl(uffd, UFFDIO_WRITEPROTECT, &op) == -1)
+    fatal("[UFFD] UFFDIO_WRITEPROTECT(%p, %ld, %d) failed: %s", addr, length, enable, strerror(errno));
+}
+
+void wake(void *addr, size_t length) {
+  uffdio_range range{.start = reinterpret_cast<uintptr_t>(addr), .len = length};
+  if (ioctl(uffd, UFFDIO_WAKE, &range) == -1) fatal("[UFFD] UFFDIO_WAKE(%p, %ld) failed: %s", addr, length, strerror(errno));
+}
+
+} // namespace utpx::fault::uffd
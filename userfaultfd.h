@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+// Thin wrappers over the userfaultfd(2) ioctls used by the userfaultfd fault backend, see intercept_memory.cpp.
+namespace utpx::fault::uffd {
+
+// Opens the process-wide userfaultfd, returns false if the kernel or our privileges don't allow it.
+// writeProtect is set if write-protect faults on anonymous memory are supported, missing-page faults are always available.
+bool open(bool &writeProtect);
+void close();
+[[nodiscard]] int fd();
+
+void registerRange(void *addr, size_t length);
+void unregisterRange(void *addr, size_t length);
+
+// These don't wake the faulting threads, call wake once the range is fully resolved.
+void copy(void *dst, const void *src, size_t length, bool writeProtect);
+void writeProtect(void *addr, size_t length, bool enable);
+void wake(void *addr, size_t length);
+
+} // namespace utpx::fault::uffd
@@ -1,9 +1,26 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <thread>
+#include <tuple>
 
+#include "device_pool.h"
+#include "host_arena.h"
 #include "intercept_kernel.h"
 #include "intercept_memory.h"
+#include "interval_map.h"
+#include "offset_learner.h"
+#include "placement_policy.h"
+#include "pointer_scan.h"
+#include "slab_allocator.h"
+#include "staging_ring.h"
+#include "stats.h"
 #include "utpx.h"
 
 // #define LOG
@@ -51,137 +68,908 @@ static _hipMemcpy originalHipMemcpy;
 static _hipGetDevice originalHipGetDevice;
 static _hipMemAdvise originalHipMemAdvise;
 static _hipMemPrefetchAsync originalHipMemPrefetchAsync;
+static _hipStreamAddCallback originalHipStreamAddCallback;
+static _hipMemcpyAsync originalHipMemcpyAsync;
+static _hipMemcpyPeerAsync originalHipMemcpyPeerAsync;
+static _hipMemcpy2D originalHipMemcpy2D;
+static _hipMemcpy2DAsync originalHipMemcpy2DAsync;
+static _hipMemsetAsync originalHipMemsetAsync;
+static _hipMemsetD16Async originalHipMemsetD16Async;
+static _hipMemsetD32Async originalHipMemsetD32Async;
+static _hipMemset2DAsync originalHipMemset2DAsync;
+static _hipFree originalHipFree;
+static _hipHostMalloc originalHipHostMalloc;
+static _hipHostRegister originalHipHostRegister;
+static _hipHostUnregister originalHipHostUnregister;
+static _hipHostGetDevicePointer originalHipHostGetDevicePointer;
+static _hipEventCreateWithFlags originalHipEventCreateWithFlags;
+static _hipEventRecord originalHipEventRecord;
+static _hipEventSynchronize originalHipEventSynchronize;
+static _hipStreamWaitEvent originalHipStreamWaitEvent;
+
+static stats::Counter uploadedBytes("mirror.uploaded.bytes");
+static stats::Counter writtenBackBytes("fault.written_back.bytes");
+static stats::Counter peerCopiedBytes("mirror.peer_copied.bytes");
+static stats::Counter filledBytes("fault.filled.bytes");
+
+// Allocations are mirrored to each device a kernel using them is launched on, up to device ordinal MaxDevices - 1.
+static constexpr int MaxDevices = 16;
+
+// The calling thread's current device, which launches use and device copies are created on.
+static int currentDevice() {
+  int device = -1;
+  if (originalHipGetDevice(&device) != hipSuccess) fatal("Cannot resolve device for allocation");
+  if (device < 0 || device >= MaxDevices) fatal("Cannot mirror to device %d, only devices up to %d are supported", device, MaxDevices - 1);
+  return device;
+}
+
+// Copies between device copies and pageable host memory go through pinned bounce buffers, see StagingRing. Constructed on first use,
+// when the original HIP functions are resolved.
+static StagingRing &stagingRing() {
+  static StagingRing ring(
+      StagingRing::Api{
+          .hostMalloc = originalHipHostMalloc,
+          .memcpy = originalHipMemcpy,
+          .memcpyAsync = originalHipMemcpyAsync,
+          .eventCreate = originalHipEventCreateWithFlags,
+          .eventRecord = originalHipEventRecord,
+          .eventSynchronize = originalHipEventSynchronize,
+      },
+      envCount("UTPX_STAGING_BUFFERS", 4), envBytes("UTPX_STAGING_CHUNK_SIZE", 4 << 20));
+  return ring;
+}
+
+// Device copies are allocated from here, one pool per device, so that freed mirrors are recycled by later allocations of a similar size on
+// the same device. A pool is only used while its device is the current one, as it allocates and waits with the current device. Constructed
+// on first use, when the original HIP functions are resolved.
+static DevicePool &devicePool(int device) {
+  static auto pools = [] {
+    std::vector<std::unique_ptr<DevicePool>> pools;
+    for (int d = 0; d < MaxDevices; ++d)
+      pools.push_back(std::make_unique<DevicePool>(
+          DevicePool::Api{
+              .malloc = originalHipMalloc,
+              .free = originalHipFree,
+              .eventCreate = originalHipEventCreateWithFlags,
+              .eventRecord = originalHipEventRecord,
+              .eventSynchronize = originalHipEventSynchronize,
+              .streamWaitEvent = originalHipStreamWaitEvent,
+          },
+          envBytes("UTPX_POOL_LIMIT", size_t(1) << 30)));
+    return pools;
+  }();
+  return *pools[device];
+}
+
+// Device copies are a cache of the host allocations: once they take up more than deviceBudget bytes on one device (see
+// UTPX_DEVICE_BUDGET), or the device runs out of memory, the least recently launched ones on that device are written back and freed, and
+// mirrored again when a launch needs them.
+static size_t deviceBudget{};
+static std::array<std::atomic_size_t, MaxDevices> mirroredBytes{}; // per device, in size classes
+static std::atomic_uint64_t launchSequence{};
+static stats::Counter evictions("mirror.evictions");
+static stats::Counter evictedBytes("mirror.evicted.bytes");
+
+// Host memory for mirrored allocations, see HostArena. Constructed on first use, like devicePool.
+static HostArena &hostArena() {
+  static HostArena arena(fault::hostPageSize(), envBytes("UTPX_HOST_REGION_SIZE", 64 << 20),
+                         std::getenv("UTPX_HOST_PIN") && std::string(std::getenv("UTPX_HOST_PIN")) == "1" && fault::keepsHostPages(),
+                         fault::keepsHostPages(), // the userfaultfd backend drops device-owned pages, splitting any huge page
+                         HostArena::Api{
+                             .hostRegister = dlSymbol<_hipHostRegister>("hipHostRegister", HipLibrarySO),
+                             .hostUnregister = dlSymbol<_hipHostUnregister>("hipHostUnregister", HipLibrarySO),
+                         });
+  return arena;
+}
+
+// Allocations smaller than a page are packed into slabs of UTPX_SLAB_SIZE bytes, each mirrored like any other allocation, so that a
+// pointer into a slab is rewritten to the slab's device copy plus its offset. Constructed on first use, like devicePool, and guarded by
+// slabLock, which is taken before registryLock when a new slab is registered.
+static std::mutex slabLock;
+static SlabAllocator &slabAllocator() {
+  static SlabAllocator slabs((envBytes("UTPX_SLAB_SIZE", 64 << 10) + fault::hostPageSize() - 1) / fault::hostPageSize() *
+                                 fault::hostPageSize(),
+                             fault::hostPageSize() - 1);
+  return slabs;
+}
+
+// Pointer offsets learned for by-value arguments, see OffsetLearner. UTPX_LEARN_OFFSETS is the number of full scans an argument is learned
+// from (default 0, learning is off) and UTPX_LEARN_RESCAN how often a learned argument is scanned in full anyway (default every 64th
+// launch). UTPX_LEARN_FILE names a file that layouts are loaded from on first use and saved to on exit, it turns learning on with 8 scans
+// unless UTPX_LEARN_OFFSETS says otherwise. Constructed on first use, like devicePool, and guarded by learnerLock. Never destroyed, as
+// static destructors run before preload_exit saves the layouts.
+static std::mutex learnerLock;
+static OffsetLearner &offsetLearner() {
+  static auto learner = [] {
+    auto file = std::getenv("UTPX_LEARN_FILE");
+    auto learner = new OffsetLearner(envCount("UTPX_LEARN_OFFSETS", file && *file ? 8 : 0), envCount("UTPX_LEARN_RESCAN", 64));
+    if (file && *file && !learner->load(file)) log("[LEARN] Cannot read %s, learning from scratch", file);
+    return learner;
+  }();
+  return *learner;
+}
+static stats::Counter learnedProbes("learn.probes");
+static stats::Counter learnedRescans("learn.rescans");
+
+// Per-allocation placement, see PlacementPolicy. UTPX_POLICY_WINDOW is the number of launches of an allocation between decisions (default
+// 8, 0 keeps every allocation mirrored), UTPX_POLICY_HYSTERESIS the number of windows in a row that must agree on a change (default 2), and
+// UTPX_POLICY_IDLE_MS how long the host must have left an allocation alone for it to become resident (default 1000). Allocations of up to
+// UTPX_MAPPED_LIMIT bytes (default 1M, 0 never) that the host touches after UTPX_MAPPED_PERCENT of their launches (default 100) are
+// mapped, see convertToMapped. UTPX_POLICY_LOG=1 prints every decision, in release builds too.
+static const PlacementPolicy &placementPolicy() {
+  static const PlacementPolicy policy(envCount("UTPX_POLICY_WINDOW", 8), envCount("UTPX_POLICY_HYSTERESIS", 2),
+                                      std::chrono::milliseconds(envCount("UTPX_POLICY_IDLE_MS", 1000)),
+                                      envBytes("UTPX_MAPPED_LIMIT", 1 << 20), envCount("UTPX_MAPPED_PERCENT", 100),
+                                      std::getenv("UTPX_POLICY_LOG") && std::string(std::getenv("UTPX_POLICY_LOG")) != "0");
+  return policy;
+}
+static stats::Counter mappedConversions("mapped.conversions");
+static stats::Counter mappedSavedBytes("mapped.saved.bytes");
+
+// A fill from hipMemset or one of its variants, repeating the low elementSize bytes of pattern.
+struct Fill {
+  uint32_t pattern;
+  size_t elementSize; // 1, 2 or 4
+};
+
+// Writes length bytes of pattern to host memory at dst, starting phase bytes into an element.
+static void writeFill(char *dst, size_t length, size_t phase, uint32_t pattern, size_t elementSize) {
+  if (elementSize == 1) {
+    std::memset(dst, int(pattern & 0xff), length);
+    return;
+  }
+  char block[64]; // a whole number of elements of every size
+  for (size_t i = 0; i < sizeof(block); ++i)
+    block[i] = char(pattern >> 8 * ((phase + i) % elementSize));
+  for (size_t done = 0; done < length; done += sizeof(block))
+    std::memcpy(dst + done, block, std::min(sizeof(block), length - done));
+}
+
+// Fills height rows of width bytes, pitch bytes apart, of device memory at ptr, ordered on stream.
+static hipError_t deviceFill(void *ptr, size_t pitch, size_t width, size_t height, uint32_t pattern, size_t elementSize,
+                             hipStream_t stream) {
+  if (height > 1 && pitch != width) return originalHipMemset2DAsync(ptr, pitch, int(pattern & 0xff), width, height, stream);
+  switch (elementSize) {
+    case 2: return originalHipMemsetD16Async(ptr, static_cast<unsigned short>(pattern), width * height / 2, stream);
+    case 4: return originalHipMemsetD32Async(ptr, static_cast<int>(pattern), width * height / 4, stream);
+    default: return originalHipMemsetAsync(ptr, int(pattern & 0xff), width * height, stream);
+  }
+}
+
+// The copy of a mirrored allocation on one device.
+struct DeviceCopy {
+  void *ptr{};
+  std::atomic_bool resident{};       // ptr is set and not being evicted, so a launch that pinned the allocation may use it
+  std::atomic_uint64_t lastLaunch{}; // launchSequence of the last launch on this device that used the copy
+  // Recorded on the stream of every launch that used the copy once it is submitted, see launchSubmitted. Launches only pin the copy until
+  // then, so a write back or a pool reuse waits for this as well, in case the kernel is still running on a stream that doesn't synchronise
+  // with the null stream. Created with the first copy on the device and kept for the allocations that reuse this object.
+  hipEvent_t lastUse{};
+
+  // Orders later work on the null stream, such as a staged write back, after the last launch that used the copy.
+  void awaitLastUse() const {
+    if (lastUse)
+      if (auto result = originalHipStreamWaitEvent(nullptr, lastUse, 0); result != hipSuccess)
+        fatal("\t\tUnable to wait for the last launch using a mirrored allocation: hipStreamWaitEvent failed with %d", result);
+  }
+};
 
 struct MirroredAllocation {
-  void *devicePtr;
-  size_t size;
+  // Held exclusively to create, copy into, evict or free a device copy, and shared while a fault is written back from one. Launches only
+  // take it to create one or to move the allocation to another device, see prepareMirrored.
+  std::shared_mutex lock;
+  // Bumped when the allocation is freed. The object is then kept for reuse by a later allocation rather than deleted, so that a registry
+  // snapshot or launch plan that is behind can still dereference it and compare the incarnation it recorded to tell that it is stale.
+  std::atomic_uint64_t incarnation{};
+  std::atomic_uint32_t pins{}; // launches being intercepted or submitted that use a device copy, none may be evicted meanwhile
+  // The device whose copy the registered host range is kept coherent with, or -1 while the range isn't registered and the host copy is the
+  // only current one. Copies on other devices are stale, and are refreshed from this one with a peer copy before they are used again.
+  std::atomic_int owner{-1};
+  std::array<DeviceCopy, MaxDevices> copies;
+  // A fill of the whole allocation recorded by hipMemset but not written anywhere yet. Only pending while no device owns the allocation,
+  // its registered range then reads as the fill. See fillMirrored.
+  std::optional<Fill> pendingFill;
+  AccessHistory history; // see placementPolicy
+  // The device address of the host range once converted to mapped memory, see convertToMapped. Set under the lock, but read without it by
+  // launches.
+  std::atomic<char *> mapped{};
+  // Set by the fault layer while handing the registered range to the device would do nothing, so that launches skip flush without taking a
+  // lock, see fault::registerPage.
+  std::atomic_bool settled{};
+  size_t size{};
+  bool hostPinned{}; // the host range is pinned, so uploads can DMA from it directly
+  bool slab{};       // packs small allocations, see SlabAllocator
+
+  // Creates the copy on device, which must be the current device.
+  [[nodiscard]] hipError_t tryCreate(int device) {
+    auto &copy = copies[device];
+    log("[MEM] Creating mirrored allocation of of %ld bytes on device %d", size, device);
+    if (!copy.lastUse)
+      if (auto result = originalHipEventCreateWithFlags(&copy.lastUse, hipEventDisableTiming); result != hipSuccess) return result;
+    auto result = devicePool(device).allocate(&copy.ptr, size);
+    if (result == hipSuccess) {
+      if (!copy.ptr) fatal("\t\tUnable to create mirrored allocation: hipMalloc produced NULL");
+      mirroredBytes[device] += DevicePool::sizeClass(size);
+      copy.resident = true;
+    }
+    return result;
+  }
 
-  void create() {
-    log("[MEM] Creating mirrored allocation of of %ld bytes on device", size);
-    if (auto result = originalHipMalloc(&devicePtr, size); result != hipSuccess) {
+  void create(int device) {
+    if (auto result = tryCreate(device); result != hipSuccess) {
       fatal("\t\tUnable to create mirrored allocation: hipMalloc(%p, %ld) failed with %d", //
-            &devicePtr, size, result);
+            &copies[device].ptr, size, result);
+    }
+  }
+
+  // Frees the copy on device. A copy on the current device goes back to its pool, one on another device is freed right away, as the pool
+  // would wait for the wrong device before handing it out again.
+  void destroy(int device, int current) {
+    auto &copy = copies[device];
+    if (!copy.ptr) return;
+    if (device == current) devicePool(device).release(copy.ptr, size, copy.lastUse);
+    else if (auto result = originalHipFree(copy.ptr); result != hipSuccess)
+      log("[MEM] hipFree(%p) of the copy on device %d failed with %d", copy.ptr, device, result);
+    mirroredBytes[device] -= DevicePool::sizeClass(size);
+    copy.ptr = nullptr;
+    copy.resident = false;
+  }
+
+  // Copies [offset, offset + length) of the host range to the copy on device, ordered before later work on stream. The host range is fully
+  // read once this returns, so it can be protected right away.
+  void mirror(int device, void *hostPtr, size_t offset, size_t length, hipStream_t stream) {
+    auto dst = static_cast<char *>(copies[device].ptr) + offset;
+    auto src = static_cast<char *>(hostPtr) + offset;
+    uploadedBytes.add(length);
+    history.migrated(length);
+    if (hostPinned) {
+      if (auto result = originalHipMemcpyAsync(dst, src, length, hipMemcpyHostToDevice, stream); result != hipSuccess) {
+        fatal("\t\tUnable to copy to mirrored allocation: hipMemcpyAsync(%p <- %p, %ld) failed with %d", //
+              dst, src, length, result);
+      }
+      return;
+    }
+    if (auto result = stagingRing().upload(dst, src, length, stream); result != hipSuccess) {
+      fatal("\t\tUnable to copy to mirrored allocation: staged upload(%p <- %p, %ld) failed with %d", //
+            dst, src, length, result);
     }
-    if (!devicePtr) fatal("\t\tUnable to create mirrored allocation: hipMalloc produced NULL");
   }
 
-  void mirror(void *hostPtr) {
-    if (auto result = originalHipMemcpy(devicePtr, hostPtr, size, hipMemcpyHostToDevice); result != hipSuccess) {
-      fatal("\t\tUnable to copy to mirrored allocation: hipMemcpy(%p <- %p, %ld) failed with %d", //
-            devicePtr, hostPtr, size, result);
+  // Uploads host-dirty chunks to the copy on device and makes the device side authoritative again, returns false if the host range is not
+  // registered.
+  bool flush(int device, uintptr_t hostPtr, hipStream_t stream = nullptr) {
+    return fault::releaseToDevice(reinterpret_cast<void *>(hostPtr), [&](size_t offset, size_t length) {
+      mirror(device, reinterpret_cast<void *>(hostPtr), offset, length, stream);
+    });
+  }
+
+  // Makes the copy on device, which must exist, the owner, refreshing it from the current owner's copy with a device to device copy, or
+  // with the pending fill if there is no owner, ordered before later work on stream. Work already queued on the owner's device must be
+  // complete by then, as it is once a StdPar algorithm returns. Host-dirty chunks are left for flush. Must hold the lock exclusively.
+  void moveTo(int device, hipStream_t stream) {
+    auto from = owner.load();
+    if (from >= 0 && from != device) {
+      log("[MEM] Moving mirrored allocation of %ld bytes from device %d to device %d", size, from, device);
+      if (auto result = originalHipMemcpyPeerAsync(copies[device].ptr, device, copies[from].ptr, from, size, stream); result != hipSuccess)
+        fatal("\t\tUnable to refresh mirrored allocation: hipMemcpyPeerAsync(%p@%d <- %p@%d, %ld) failed with %d", //
+              copies[device].ptr, device, copies[from].ptr, from, size, result);
+      peerCopiedBytes.add(size);
+      history.migrated(size);
     }
+    if (pendingFill) {
+      log("[MEM] Applying pending fill of 0x%x to mirrored allocation of %ld bytes on device %d", pendingFill->pattern, size, device);
+      if (auto result = deviceFill(copies[device].ptr, size, size, 1, pendingFill->pattern, pendingFill->elementSize, stream);
+          result != hipSuccess)
+        fatal("\t\tUnable to apply pending fill to mirrored allocation: memset(%p, 0x%x, %ld) failed with %d", //
+              copies[device].ptr, pendingFill->pattern, size, result);
+      pendingFill.reset();
+    }
+    owner = device;
+  }
+
+  // Where kernels on device find the allocation: the mapped host range once converted, otherwise the copy on device.
+  [[nodiscard]] char *devicePointer(int device) const {
+    auto ptr = mapped.load(std::memory_order_acquire);
+    return ptr ? ptr : static_cast<char *>(copies[device].ptr);
+  }
+
+  // The current device copy once what the host has written since is uploaded to it, ordered before later work on stream, or nullptr if
+  // the host copy is the only current one. Must hold the lock exclusively.
+  [[nodiscard]] char *current(uintptr_t hostPtr, hipStream_t stream = nullptr) {
+    auto device = owner.load();
+    if (device < 0 || !flush(device, hostPtr, stream)) return nullptr;
+    return static_cast<char *>(copies[device].ptr);
   }
 };
 
-static std::shared_mutex allocationsLock{};
-static std::unordered_map<uintptr_t, MirroredAllocation> allocations;
+// The allocation registry is read without locks: lookups go through an immutable Registry snapshot, and hipMallocManaged and hipFree
+// publish an updated copy under registryLock. A thread keeps the snapshot it last used and only loads the published one again once
+// registryGeneration has moved on, so launches on many threads share nothing but a rarely written generation counter.
+struct RegistryEntry {
+  MirroredAllocation *alloc;
+  uint64_t incarnation; // of alloc when it was registered, see MirroredAllocation::incarnation
+};
+
+struct Registry {
+  uint64_t generation{};
+  ChunkedIntervalMap<RegistryEntry> allocations; // chunks shared with the previous snapshots, so that publishing copies little of it
+  // Ranges registered by the last few generations, oldest first, so that a launch plan resolved against an older snapshot can tell whether
+  // it saw a value inside one of them. Every range registered after generation addedSince is in here.
+  std::vector<std::tuple<uint64_t, uintptr_t, size_t>> added;
+  uint64_t addedSince{};
+};
+
+static constexpr size_t RegistryAddedRanges = 64;
+static std::mutex registryLock; // serialises writers of publishedRegistry and guards retiredAllocations
+static std::shared_ptr<const Registry> publishedRegistry; // accessed with std::atomic_load and std::atomic_store
+static std::atomic_uint64_t registryGeneration{};
+static std::vector<MirroredAllocation *> retiredAllocations; // freed, ready for reuse
+
+static thread_local std::shared_ptr<const Registry> registrySnapshot;
+static thread_local size_t registryViewDepth{};
+
+// Pins the calling thread's registry snapshot for the duration of an intercepted call. Nested views, such as the one an eviction takes in
+// the middle of a launch, share the outermost view's snapshot, so that references into it stay valid until the outermost view is gone.
+class RegistryView {
+public:
+  RegistryView() {
+    if (registryViewDepth++ == 0 &&
+        (!registrySnapshot || registrySnapshot->generation != registryGeneration.load(std::memory_order_acquire)))
+      registrySnapshot = std::atomic_load(&publishedRegistry);
+  }
+  ~RegistryView() { registryViewDepth--; }
+  RegistryView(const RegistryView &) = delete;
+  RegistryView &operator=(const RegistryView &) = delete;
+
+  const Registry &operator*() const {
+    if (registrySnapshot) return *registrySnapshot;
+    static const Registry empty; // nothing has been allocated yet
+    return empty;
+  }
+  const Registry *operator->() const { return &**this; }
+};
+
+// Publishes a copy of the registry with update applied to it, the copy shares every chunk of allocations that update doesn't change. Must
+// hold registryLock.
+template <typename F> static void publishRegistry(F update) {
+  auto current = std::atomic_load(&publishedRegistry);
+  auto next = current ? std::make_shared<Registry>(*current) : std::make_shared<Registry>();
+  next->generation++;
+  update(*next);
+  auto generation = next->generation;
+  std::atomic_store(&publishedRegistry, std::shared_ptr<const Registry>(std::move(next)));
+  registryGeneration.store(generation, std::memory_order_release);
+}
+
+// Registers [base, base + size) as a new allocation. Must hold registryLock.
+static void registerAllocation(uintptr_t base, size_t size, bool hostPinned, bool slab) {
+  MirroredAllocation *alloc;
+  if (retiredAllocations.empty()) alloc = new MirroredAllocation();
+  else {
+    alloc = retiredAllocations.back();
+    retiredAllocations.pop_back();
+  }
+  alloc->size = size;
+  alloc->hostPinned = hostPinned;
+  alloc->slab = slab;
+  alloc->owner = -1;
+  alloc->mapped = nullptr;
+  alloc->history.reset();
+  for (auto &copy : alloc->copies)
+    copy.lastLaunch = 0;
+  bool inserted{};
+  publishRegistry([&](Registry &registry) {
+    inserted = registry.allocations.emplace(base, size, RegistryEntry{.alloc = alloc, .incarnation = alloc->incarnation});
+    if (!inserted) return;
+    registry.added.emplace_back(registry.generation, base, size);
+    if (registry.added.size() > RegistryAddedRanges) {
+      registry.addedSince = std::get<0>(registry.added.front());
+      registry.added.erase(registry.added.begin());
+    }
+  });
+  if (!inserted) {
+    log("[MEM] Allocation 0x%lx+%zu overlaps a tracked one, not mirroring it", base, size);
+    retiredAllocations.push_back(alloc);
+  }
+}
+
+// Unregisters the allocation at base, which must have no device copies left. Must hold registryLock and the allocation's lock exclusively.
+static void unregisterAllocation(uintptr_t base, MirroredAllocation *alloc) {
+  alloc->incarnation++;
+  publishRegistry([&](Registry &registry) {
+    if (auto it = registry.allocations.find(base); it != registry.allocations.end()) registry.allocations.erase(it);
+  });
+  retiredAllocations.push_back(alloc);
+}
+
+// Locks the allocation of entry exclusively, the returned lock doesn't own it if the allocation has been freed since entry was looked up.
+static std::unique_lock<std::shared_mutex> lockCurrent(const RegistryEntry &entry) {
+  std::unique_lock<std::shared_mutex> lock(entry.alloc->lock);
+  if (entry.alloc->incarnation != entry.incarnation) lock.unlock();
+  return lock;
+}
 
 // see rocvirtual.cpp VirtualGPU::submitKernelInternal
 //                    VirtualGPU::processMemObjects
 
-static auto findHostAllocations(uintptr_t maybePointer) {
-  return std::find_if(allocations.begin(), allocations.end(),
-                      [&](auto &kv) { return maybePointer >= kv.first && maybePointer < kv.first + kv.second.size; });
-}
-
-static void *findHostAllocationsAndCreateMirrored(uintptr_t maybePointer, int device, hipStream_t stream) {
-  if (mode == Mode::Device) return nullptr;
-  for (auto &[hostPtr, alloc] : allocations) {
-    if (maybePointer >= hostPtr && maybePointer < hostPtr + alloc.size) {
-      size_t offset = maybePointer - hostPtr;
-      log("\t\tLocated host ptr: %p (offset=%ld) from (0x%lx+%ld)", reinterpret_cast<void *>(maybePointer), offset, hostPtr, alloc.size);
-      switch (mode) {
-        case Mode::Device: break;
-        case Mode::Advise:
-          if (auto result = originalHipMemPrefetchAsync(reinterpret_cast<void *>(maybePointer), alloc.size, device, stream);
-              result != hipSuccess)
-            log("WARN: hipMemPrefetchAsync failed with %d", result);
+static auto findHostAllocations(const Registry &registry, uintptr_t maybePointer) {
+  return registry.allocations.findContaining(maybePointer);
+}
+
+// Allocations already prepared for the launch being intercepted and pinned by it, these must keep their device copy until it is submitted.
+static thread_local std::vector<MirroredAllocation *> launchPrepared;
+static thread_local int launchDevice;
+
+static void releaseLaunchPins() {
+  for (auto alloc : launchPrepared)
+    alloc->pins.fetch_sub(1, std::memory_order_release);
+  launchPrepared.clear();
+}
+
+// Frees the device copy of the least recently launched allocation on device, which must be the current device, that no launch in flight
+// uses, returns false if there is none left. Stale copies go first, as freeing them needs no write back, and resident ones last, as the
+// host isn't going to take them back. Allocations locked by other threads are passed over rather than waited for, as their owner may be
+// evicting too.
+static bool evictLeastRecentlyLaunched(const Registry &registry, int device) {
+  std::vector<const MirroredAllocation *> busy;
+  auto before = [device](const MirroredAllocation *a, const MirroredAllocation *b) {
+    return std::make_tuple(a->owner == device, a->history.placement == Placement::Resident, a->copies[device].lastLaunch.load()) <
+           std::make_tuple(b->owner == device, b->history.placement == Placement::Resident, b->copies[device].lastLaunch.load());
+  };
+  while (true) {
+    const IntervalMap<RegistryEntry>::Entry *victim{};
+    for (const auto &entry : registry.allocations) {
+      auto alloc = entry.value.alloc;
+      if (!alloc->copies[device].resident || alloc->pins || std::find(busy.begin(), busy.end(), alloc) != busy.end()) continue;
+      if (!victim || before(alloc, victim->value.alloc)) victim = &entry;
+    }
+    if (!victim) return false;
+    auto alloc = victim->value.alloc;
+    auto &copy = alloc->copies[device];
+    std::unique_lock<std::shared_mutex> lock(alloc->lock, std::try_to_lock);
+    if (!lock || alloc->incarnation != victim->value.incarnation || !copy.ptr) {
+      busy.push_back(alloc);
+      continue;
+    }
+    // Launches pin a resident device copy before checking that it is resident, so either they see it go or it is pinned by now.
+    copy.resident = false;
+    if (alloc->pins) {
+      copy.resident = true;
+      busy.push_back(alloc);
+      continue;
+    }
+    log("[MEM] Evicting mirrored allocation host=0x%lx device=%p+%ld from device %d", victim->base, copy.ptr, alloc->size, device);
+    if (alloc->owner == device) {
+      copy.awaitLastUse();
+      fault::reclaimFromDevice(reinterpret_cast<void *>(victim->base), [&](size_t offset, size_t length, void *dst) {
+        if (auto result = stagingRing().download(dst, static_cast<char *>(copy.ptr) + offset, length, nullptr); result != hipSuccess)
+          fatal("\t\tUnable to write back evicted allocation: staged download(%p <- %p+%ld, %ld) failed with %d", //
+                dst, copy.ptr, offset, length, result);
+        writtenBackBytes.add(length);
+        alloc->history.migrated(length);
+      });
+      alloc->owner = -1;
+    }
+    alloc->destroy(device, device);
+    ++evictions;
+    evictedBytes.add(alloc->size);
+    return true;
+  }
+}
+
+// Converts an allocation that the host and the device take turns on after every launch into pinned host memory that kernels access in
+// place, so that each turn costs remote accesses instead of a fault and a copy each way. The device copy that owns the allocation is
+// written back, every copy is freed, and the host range is no longer protected. Returns false, leaving it to a later launch, while a launch
+// in flight still uses a device copy or a fill is pending, and puts the allocation back to Mirror if HIP can't map it. Must hold the lock
+// exclusively.
+static bool convertToMapped(MirroredAllocation &alloc, uintptr_t hostPtr) {
+  if (alloc.pins || alloc.pendingFill) return false;
+  auto host = reinterpret_cast<void *>(hostPtr);
+  if (auto owner = alloc.owner.load(); owner >= 0) {
+    alloc.copies[owner].awaitLastUse();
+    fault::reclaimFromDevice(host, [&](size_t offset, size_t length, void *dst) {
+      auto src = static_cast<char *>(alloc.copies[owner].ptr) + offset;
+      if (auto result = stagingRing().download(dst, src, length, nullptr); result != hipSuccess)
+        fatal("\t\tUnable to write back allocation to map: staged download(%p <- %p, %ld) failed with %d", dst, src, length, result);
+      writtenBackBytes.add(length);
+    });
+    alloc.owner = -1;
+  }
+  auto current = currentDevice();
+  for (int device = 0; device < MaxDevices; ++device)
+    alloc.destroy(device, current);
+  // a pinned arena mapping is device-accessible already
+  if (!alloc.hostPinned)
+    if (auto result = originalHipHostRegister(host, alloc.size, hipHostRegisterPortable | hipHostRegisterMapped); result != hipSuccess) {
+      log("[MEM] hipHostRegister(%p, %ld) failed with %d, keeping the allocation mirrored", host, alloc.size, result);
+      alloc.history.placement = Placement::Mirror;
+      return false;
+    }
+  void *device{};
+  if (auto result = originalHipHostGetDevicePointer(&device, host, 0); result != hipSuccess) {
+    log("[MEM] hipHostGetDevicePointer(%p) failed with %d, keeping the allocation mirrored", host, result);
+    if (!alloc.hostPinned) originalHipHostUnregister(host);
+    alloc.history.placement = Placement::Mirror;
+    return false;
+  }
+  log("[MEM] Mapped allocation host=%p+%ld, device=%p", host, alloc.size, device);
+  alloc.mapped.store(static_cast<char *>(device), std::memory_order_release);
+  ++mappedConversions;
+  return true;
+}
+
+// Makes the allocation ready for a kernel launch on device and returns the device pointer that should replace the host pointer, if any.
+// The allocation stays pinned until the launch is submitted, see launchPrepared.
+static void *prepareMirrored(const Registry &registry, MirroredAllocation &alloc, uint64_t incarnation, uintptr_t hostPtr,
+                             uintptr_t maybePointer, int device, hipStream_t stream, uint64_t sequence) {
+  switch (mode) {
+    case Mode::Device: break;
+    case Mode::Advise:
+      if (auto result = originalHipMemPrefetchAsync(reinterpret_cast<void *>(maybePointer), alloc.size, device, stream);
+          result != hipSuccess)
+        log("WARN: hipMemPrefetchAsync failed with %d", result);
+      return nullptr;
+    case Mode::Mirror: {
+      kernel::suspendInterception(); // hipMemcpy may launch more kernels, so we suspend interception for now
+      auto &copy = alloc.copies[device];
+      // A device copy that exists already and owns the allocation is flushed without taking the lock, as once pinned it can't be evicted,
+      // see evictLeastRecentlyLaunched, and not at all while the range is settled. Creating one, moving the allocation from another
+      // device, or mirroring a range that isn't registered, takes the lock: another thread registering the range while we read it would
+      // fault with the staging ring held.
+      alloc.pins++;
+      if (auto mapped = alloc.mapped.load(std::memory_order_acquire); mapped) {
+        mappedSavedBytes.add(alloc.history.savedPerLaunch.load(std::memory_order_relaxed));
+        kernel::resumeInterception();
+        return mapped + (maybePointer - hostPtr);
+      }
+      bool mapping = alloc.history.placement.load(std::memory_order_relaxed) == Placement::Mapped;
+      if (!mapping && copy.resident && alloc.owner == device &&
+          (alloc.settled.load(std::memory_order_acquire) || alloc.flush(device, hostPtr, stream))) {
+        log("\t\t-> Existing mirrored allocation exists: %p", copy.ptr);
+      } else {
+        alloc.pins--;
+        std::unique_lock<std::shared_mutex> lock(alloc.lock);
+        if (alloc.incarnation != incarnation) { // freed by another thread, which is a use after free in the application
+          kernel::resumeInterception();
           return nullptr;
-        case Mode::Mirror:
-          if (alloc.devicePtr) {
-            log("\t\t-> Existing mirrored allocation exists: %p", alloc.devicePtr);
-          } else {
-            log("\t\t-> No mirrored allocation, creating...");
-            kernel::suspendInterception(); // hipMemcpy may launch more kernels, so we suspend interception for now
-            alloc.create();
-            alloc.mirror(reinterpret_cast<void *>(hostPtr));
-            fault::registerPage(reinterpret_cast<void *>(hostPtr), alloc.size);
-            kernel::resumeInterception();
-          }
-          return &alloc.devicePtr;
+        }
+        if (mapping && !alloc.mapped) convertToMapped(alloc, hostPtr);
+        if (auto mapped = alloc.mapped.load(); mapped) { // by us or by another thread in the meantime
+          alloc.pins++;
+          kernel::resumeInterception();
+          return mapped + (maybePointer - hostPtr);
+        }
+        if (!copy.ptr) {
+          log("\t\t-> No mirrored allocation on device %d, creating...", device);
+          auto classSize = DevicePool::sizeClass(alloc.size);
+          while (deviceBudget && mirroredBytes[device] + classSize > deviceBudget && evictLeastRecentlyLaunched(registry, device)) {}
+          if (deviceBudget) devicePool(device).trim(deviceBudget - std::min(deviceBudget, mirroredBytes[device] + classSize));
+          hipError_t result;
+          while ((result = alloc.tryCreate(device)) == hipErrorOutOfMemory && evictLeastRecentlyLaunched(registry, device)) {}
+          if (result != hipSuccess)
+            fatal("\t\tUnable to create mirrored allocation: hipMalloc(%p, %ld) failed with %d after evicting every other mirror", //
+                  &copy.ptr, alloc.size, result);
+        }
+        alloc.pins++;
+        alloc.moveTo(device, stream);
+        if (!alloc.flush(device, hostPtr, stream)) {
+          alloc.mirror(device, reinterpret_cast<void *>(hostPtr), 0, alloc.size, stream);
+          fault::registerPage(reinterpret_cast<void *>(hostPtr), alloc.size, &alloc.settled);
+        }
       }
+      copy.lastLaunch.store(sequence, std::memory_order_relaxed);
+      kernel::resumeInterception();
+      return static_cast<char *>(copy.ptr) + (maybePointer - hostPtr);
     }
   }
   return nullptr;
 }
 
-void kernel::interceptKernelLaunch(const void *fn, const HSACOKernelMeta &meta, void **args, dim3, dim3, hipStream_t stream) {
-  log("\tAttempting to replace host allocations for %p, argCount=%ld, argSize=%ld", fn, meta.args.size(), meta.kernargSize);
+// The rewrites resolved for one kernel on one device, so that repeated launches with the same arguments skip the allocation search.
+// A plan is resolved against a registry snapshot and checked against later ones with planStillValid.
+struct LaunchPlan {
+  struct Rewrite {
+    size_t byteOffset; // offset into the argument, 0 for plain pointer arguments
+    uintptr_t hostPtr; // the (possibly interior) host pointer found in the argument
+    uintptr_t hostBase;
+    MirroredAllocation *alloc;
+    uint64_t incarnation;
+  };
+  struct ArgPlan {
+    bool resolved;
+    uint64_t generation;        // of the registry snapshot the rewrites were last checked against
+    std::vector<char> snapshot; // argument bytes the rewrites were resolved from
+    std::vector<Rewrite> rewrites;
+  };
+  std::vector<ArgPlan> args;
+};
 
-  std::unique_lock<std::shared_mutex> write(allocationsLock);
-  log("\tCurrent host allocations (%zu): ", allocations.size());
-  {
-    int p = 0;
-    size_t totalHost = 0;
-    size_t totalDevice = 0;
-    for (const auto &[hostPtr, alloc] : allocations) {
-      log("\t\t[%3d] host=(0x%lx+%ld) => device=%p", p, hostPtr, alloc.size, alloc.devicePtr);
-      p++;
-      totalHost += alloc.size;
-      totalDevice += alloc.devicePtr ? alloc.size : 0;
+struct LaunchPlanKey {
+  const void *fn;
+  int device;
+  bool operator==(const LaunchPlanKey &that) const { return fn == that.fn && device == that.device; }
+};
+
+struct LaunchPlanKeyHash {
+  size_t operator()(const LaunchPlanKey &key) const { return std::hash<const void *>{}(key.fn) ^ std::hash<int>{}(key.device); }
+};
+
+// Plans are kept per thread, so that launching threads never contend on them.
+static thread_local std::unordered_map<LaunchPlanKey, LaunchPlan, LaunchPlanKeyHash> launchPlans;
+static stats::Counter launchPlanHits("launch.plan.hits");
+static stats::Counter launchPlanMisses("launch.plan.misses");
+
+// Rewritten arguments are staged here in kernarg layout, so that the caller's argument storage is left as-is.
+static thread_local std::vector<void *> launchArgs;
+static thread_local std::vector<char> launchArgData;
+
+// Speculative write back, see UTPX_SPECULATIVE_WRITEBACK. Mirrored ranges the host is expected to touch after a launch are queued with
+// their fault::speculationToken, and written back by speculationThread once the stream reaches a callback enqueued behind the kernel.
+static bool speculativeWriteBack = true;
+static thread_local std::vector<std::pair<uintptr_t, uint64_t>> launchSpeculations;
+static std::mutex speculationLock;
+static std::condition_variable speculationReady;
+static std::vector<std::pair<uintptr_t, uint64_t>> pendingSpeculations;
+static bool speculationTerminate{};
+static std::thread speculationThread;
+
+// Offsets of the windows of a by-value argument that fall within the bounds of the tracked allocations, see forEachCandidate.
+static thread_local std::vector<size_t> launchCandidates;
+
+// Calls f(byteOffset, value) for every pointer-sized window of an argument that may hold a pointer. Windows of a larger argument are first
+// filtered against [lo, hi), the bounds of every tracked allocation, so f only sees values that can be inside one.
+template <typename F>
+static void forEachCandidate(const HSACOKernelMeta &meta, size_t i, const char *data, uintptr_t lo, uintptr_t hi, F f) {
+  const auto &arg = meta.args[i];
+  if (arg.size == sizeof(void *)) { // same size as a pointer, check if it is one
+    uintptr_t value;
+    std::memcpy(&value, data, sizeof(uintptr_t));
+    f(0, value);
+    return;
+  }
+  // type larger than a pointer, it may be a struct containing pointers
+  auto minIncrement = meta.packed(i) ? 1 : 2; // check every byte if packed, two byte alignment otherwise for (TODO maybe 8 byte align?)
+  scanPointerCandidates(data, arg.size, minIncrement, lo, hi, launchCandidates);
+  size_t next = 0;
+  for (auto byteOffset : launchCandidates) {
+    if (byteOffset < next) continue; // don't probe inside a pointer we've already matched
+    uintptr_t value;
+    std::memcpy(&value, data + byteOffset, sizeof(uintptr_t));
+    if (f(byteOffset, value)) next = byteOffset + sizeof(uintptr_t);
+  }
+}
+
+static void resolveArg(const Registry &registry, const HSACOKernelMeta &meta, size_t i, const char *data, LaunchPlan::ArgPlan &plan) {
+  plan.resolved = true;
+  plan.generation = registry.generation;
+  plan.snapshot.assign(data, data + meta.args[i].size);
+  plan.rewrites.clear();
+  auto rewrite = [&](size_t byteOffset, uintptr_t maybePointer) {
+    auto it = registry.allocations.findContaining(maybePointer);
+    if (it == registry.allocations.end()) return false;
+    log("\t\tLocated host ptr: %p (offset=%ld) from (0x%lx+%ld) at argument offset %ld", //
+        reinterpret_cast<void *>(maybePointer), maybePointer - it->base, it->base, it->size, byteOffset);
+    plan.rewrites.push_back({.byteOffset = byteOffset,
+                             .hostPtr = maybePointer,
+                             .hostBase = it->base,
+                             .alloc = it->value.alloc,
+                             .incarnation = it->value.incarnation});
+    return true;
+  };
+
+  // held until the scan is recorded, as another thread may update the layout in the meantime
+  std::unique_lock<std::mutex> learning;
+  OffsetLearner::Layout *layout{};
+  if (meta.args[i].size > sizeof(void *) && offsetLearner().enabled()) {
+    learning = std::unique_lock<std::mutex>(learnerLock);
+    layout = offsetLearner().find(meta.name, i, meta.args[i].size);
+  }
+  if (layout && offsetLearner().probeOnly(*layout)) {
+    if (std::all_of(layout->offsets.begin(), layout->offsets.end(), [&](size_t byteOffset) {
+          uintptr_t value;
+          std::memcpy(&value, data + byteOffset, sizeof(uintptr_t));
+          return rewrite(byteOffset, value);
+        })) {
+      ++learnedProbes;
+      return;
     }
-    log("\tTotal host = %ld MB, device = %ld MB", totalHost / 1024 / 1024, totalDevice / 1024 / 1024);
+    log("\t\tA learned offset of argument %zu holds no tracked pointer, scanning it in full", i);
+    ++learnedRescans;
+    plan.rewrites.clear();
   }
+  forEachCandidate(meta, i, data, registry.allocations.lowerBound(), registry.allocations.upperBound(), rewrite);
+  if (!layout) return;
+  launchCandidates.clear();
+  for (const auto &r : plan.rewrites)
+    launchCandidates.push_back(r.byteOffset);
+  offsetLearner().recordScan(*layout, launchCandidates);
+}
 
-  int device = -1;
-  if (originalHipGetDevice(&device) != hipSuccess) fatal("Cannot resolve device for allocation");
+// Whether a plan resolved against an older registry snapshot still holds for this one: none of its allocations have been freed since, and
+// no range registered since covers a value in its snapshot. A plan older than every range the registry remembers is resolved again.
+static bool planStillValid(const Registry &registry, LaunchPlan::ArgPlan &plan) {
+  if (plan.generation == registry.generation) return true;
+  if (plan.generation < registry.addedSince) return false;
+  for (const auto &r : plan.rewrites)
+    if (r.alloc->incarnation != r.incarnation) return false;
+  for (const auto &[generation, base, size] : registry.added) {
+    if (generation <= plan.generation) continue;
+    // A new allocation only matters to plans that saw a value inside its range and left it alone. Check every byte offset of the snapshot,
+    // this is a superset of the windows resolveArg probed.
+    scanPointerCandidates(plan.snapshot.data(), plan.snapshot.size(), 1, base, base + size, launchCandidates);
+    if (!launchCandidates.empty()) return false;
+  }
+  plan.generation = registry.generation;
+  return true;
+}
+
+void **kernel::interceptKernelLaunch(const void *fn, const HSACOKernelMeta &meta, void **args, dim3, dim3, hipStream_t stream) {
+  // hipModuleLaunchKernel may pass its arguments in extra instead, which we leave alone
+  if (mode == Mode::Device || !args) return args;
+  log("\tAttempting to replace host allocations for %p, argCount=%ld, argSize=%ld", fn, meta.args.size(), meta.kernargSize);
 
-  for (size_t i = 0; i < meta.args.size(); i++) {
+  RegistryView view;
+  const Registry &registry = *view;
+  log("\tCurrent host allocations: %zu", registry.allocations.size());
+
+  // callers only pass the explicit arguments, the hidden ones that the runtime fills in follow them
+  auto argCount = size_t(std::find_if(meta.args.begin(), meta.args.end(),
+                                      [](const auto &arg) { return arg.kind == HSACOKernelMeta::Arg::Kind::Hidden; }) -
+                         meta.args.begin());
+  auto device = launchDevice = currentDevice();
+  auto &plan = launchPlans[LaunchPlanKey{fn, device}];
+  if (plan.args.size() != argCount) plan.args.resize(argCount);
+  launchArgs.assign(args, args + argCount);
+  launchArgData.resize(meta.kernargSize);
+  releaseLaunchPins(); // launchSubmitted or launchFailed normally has, this is in case the previous launch never got to either
+  // only orders evictions, so an increment lost to a concurrent launch doesn't matter and needn't cost an atomic read-modify-write
+  auto sequence = launchSequence.load(std::memory_order_relaxed) + 1;
+  launchSequence.store(sequence, std::memory_order_relaxed);
+  launchSpeculations.clear();
+
+  bool hit = true;
+  for (size_t i = 0; i < argCount; i++) {
     const HSACOKernelMeta::Arg &arg = meta.args[i];
-    if (arg.kind == HSACOKernelMeta::Arg::Kind::Hidden) continue;
     if (arg.kind == HSACOKernelMeta::Arg::Kind::Unknown) {
       fatal("\tUnknown arg! [%ld] (%ld + %ld) ptr=%p", i, arg.offset, arg.size, args[i]);
     }
     log("\tChecking argument [%ld] (%ld + %ld) ptr=%p", i, arg.offset, arg.size, args[i]);
     if (arg.size < sizeof(void *)) continue;
-    if (arg.size == sizeof(void *)) {                   // same size as a pointer, check if it is one
-      auto target = reinterpret_cast<void **>(args[i]); // we're looking for a void* in our arg list
-      if (!target) return;
-      auto deref = reinterpret_cast<uintptr_t>(*target);
-      if (auto that = findHostAllocationsAndCreateMirrored(deref, device, stream); that) {
-        log("\t\t-> Rewritten pointer argument with mirrored: old=%p, new=%p", args[i], that);
-        args[i] = that;
-      }
-    } else {                                      // type larger than a pointer, it may be a struct containing pointers
-      auto minIncrement = meta.packed(i) ? 1 : 2; // check every byte if packed, two byte alignment otherwise for (TODO maybe 8 byte align?)
-      char *argData = reinterpret_cast<char *>(args[i]);
-      if (!argData) continue;
-      for (size_t byteOffset = 0; byteOffset < arg.size; byteOffset += minIncrement) {
-        auto maybePointer = *reinterpret_cast<uintptr_t *>(argData + byteOffset);
-        if (auto that = findHostAllocationsAndCreateMirrored(maybePointer, device, stream); that) {
-          log("\t\t-> Rewritten pointer argument at struct offset %ld with mirrored: old=%p, new=%p", byteOffset, argData + byteOffset,
-              that);
-          std::memcpy(argData + byteOffset, that, sizeof(void *));
+    auto argData = reinterpret_cast<const char *>(args[i]);
+    if (!argData) continue;
+
+    auto &argPlan = plan.args[i];
+    if (!argPlan.resolved || argPlan.snapshot.size() != arg.size || std::memcmp(argPlan.snapshot.data(), argData, arg.size) != 0 ||
+        !planStillValid(registry, argPlan)) {
+      hit = false;
+      resolveArg(registry, meta, i, argData, argPlan);
+    }
+    if (argPlan.rewrites.empty()) continue;
+
+    char *staged = launchArgData.data() + arg.offset;
+    std::memcpy(staged, argData, arg.size);
+    for (const auto &r : argPlan.rewrites) {
+      // an allocation passed in several arguments only needs to be handed to the device once
+      bool prepared = std::find(launchPrepared.begin(), launchPrepared.end(), r.alloc) != launchPrepared.end();
+      if (auto that = prepared ? r.alloc->devicePointer(device) + (r.hostPtr - r.hostBase)
+                               : prepareMirrored(registry, *r.alloc, r.incarnation, r.hostBase, r.hostPtr, device, stream, sequence);
+          that) {
+        log("\t\t-> Rewritten pointer argument at offset %ld with mirrored: old=%p, new=%p", r.byteOffset,
+            reinterpret_cast<void *>(r.hostPtr), that);
+        std::memcpy(staged + r.byteOffset, &that, sizeof(void *));
+        launchArgs[i] = staged;
+        if (prepared) continue;
+        launchPrepared.push_back(r.alloc);
+        auto placement = r.alloc->history.placement.load(std::memory_order_relaxed);
+        bool touched{};
+        // a settled range hasn't been touched since it was handed off, and no speculation token is out, so only Streamed needs one
+        bool settled = placement != Placement::Streamed && r.alloc->settled.load(std::memory_order_acquire);
+        if (!settled && (speculativeWriteBack || placementPolicy().enabled())) {
+          // Mirror speculates only if the host came back after the previous launch, Streamed always, and Resident never.
+          auto token = fault::speculationToken(reinterpret_cast<void *>(r.hostBase), placement == Placement::Streamed, touched);
+          if (token && (placement == Placement::Streamed || (placement == Placement::Mirror && speculativeWriteBack)))
+            launchSpeculations.emplace_back(r.hostBase, token);
         }
+        placementPolicy().launched(r.alloc->history, touched, reinterpret_cast<void *>(r.hostBase), r.alloc->size);
       }
     }
   }
+  if (hit) ++launchPlanHits;
+  else
+    ++launchPlanMisses;
   log("\t----");
+  return launchArgs.data();
+}
+
+// HIP doesn't allow API calls from stream callbacks, so the callback only queues the ranges for a background thread to write back.
+static void speculationCallback(hipStream_t, hipError_t status, void *userData) {
+  std::unique_ptr<std::vector<std::pair<uintptr_t, uint64_t>>> ranges(static_cast<std::vector<std::pair<uintptr_t, uint64_t>> *>(userData));
+  if (status != hipSuccess) return;
+  {
+    std::lock_guard<std::mutex> guard(speculationLock);
+    pendingSpeculations.insert(pendingSpeculations.end(), ranges->begin(), ranges->end());
+  }
+  speculationReady.notify_one();
 }
 
-void fault::handleUserspaceFault(void *faultAddr, void *allocAddr, size_t allocLength) {
-  std::shared_lock<std::shared_mutex> read(allocationsLock);
-  if (auto it = allocations.find(reinterpret_cast<uintptr_t>(allocAddr)); it != allocations.end()) {
-    log("[KERNEL] \t\tfound device ptr in fault handler  host=%p, device=%p+%ld, fault is %p (offset=%lu)", //
-        allocAddr, it->second.devicePtr, it->second.size, faultAddr,
-        reinterpret_cast<uintptr_t>(faultAddr) - reinterpret_cast<uintptr_t>(allocAddr));
-    if (auto result = originalHipMemcpy(allocAddr, it->second.devicePtr, allocLength, hipMemcpyDeviceToHost); result != hipSuccess) {
-      log("[KERNEL] hipMemcpy writeback failed: %d", result);
+static void speculationWorker() {
+  std::unique_lock<std::mutex> lock(speculationLock);
+  while (true) {
+    speculationReady.wait(lock, []() { return speculationTerminate || !pendingSpeculations.empty(); });
+    if (speculationTerminate) break;
+    auto ranges = std::move(pendingSpeculations);
+    pendingSpeculations.clear();
+    lock.unlock();
+    for (auto [hostBase, token] : ranges) {
+      log("[MEM] Speculatively writing back %p", reinterpret_cast<void *>(hostBase));
+      fault::writeBackSpeculatively(reinterpret_cast<void *>(hostBase), token);
     }
-    fault::unregisterPage(allocAddr);
-  } else {
-    log("[KERNEL] \t\t!found device ptr in fault handler %p+%ld", allocAddr, allocLength);
+    lock.lock();
+  }
+}
+
+void kernel::launchSubmitted(hipStream_t stream) {
+  // recorded before the pins go, so that an eviction that sees the copy unpinned also sees this launch in lastUse
+  for (auto alloc : launchPrepared)
+    if (!alloc->mapped)
+      if (auto result = originalHipEventRecord(alloc->copies[launchDevice].lastUse, stream); result != hipSuccess)
+        fatal("[KERNEL] hipEventRecord after a launch using a mirrored allocation failed with %d", result);
+  releaseLaunchPins();
+  if (launchSpeculations.empty()) return;
+  {
+    // started on first use rather than in preload_main, as the constructor may run before this TU's statics are initialised
+    std::lock_guard<std::mutex> guard(speculationLock);
+    if (!speculationThread.joinable()) speculationThread = std::thread(speculationWorker);
+  }
+  auto ranges = new std::vector<std::pair<uintptr_t, uint64_t>>(std::move(launchSpeculations));
+  launchSpeculations.clear();
+  if (auto result = originalHipStreamAddCallback(stream, speculationCallback, ranges, 0); result != hipSuccess) {
+    log("[KERNEL] hipStreamAddCallback failed with %d, skipping speculative write back", result);
+    delete ranges;
+  }
+}
+
+void kernel::launchFailed() {
+  // nothing ran, so there is nothing to wait for before evicting and the host doesn't need the ranges back ahead of time
+  releaseLaunchPins();
+  launchSpeculations.clear();
+}
+
+void fault::handleUserspaceFault(void *faultAddr, void *allocAddr, size_t offset, size_t length, void *dst) {
+  // Loads the published registry rather than taking a RegistryView, as the faulting thread may be in the middle of an intercepted call.
+  auto registry = std::atomic_load(&publishedRegistry);
+  const IntervalMap<RegistryEntry>::Entry *entry{};
+  if (registry)
+    if (auto it = registry->allocations.find(reinterpret_cast<uintptr_t>(allocAddr)); it != registry->allocations.end()) entry = &*it;
+  if (!entry) {
+    log("[KERNEL] \t\t!found device ptr in fault handler %p+%ld", allocAddr, offset + length);
+    return;
+  }
+  auto alloc = entry->value.alloc;
+  std::shared_lock<std::shared_mutex> read(alloc->lock);
+  auto owner = alloc->owner.load();
+  if (alloc->incarnation != entry->value.incarnation || (owner < 0 && !alloc->pendingFill)) {
+    log("[KERNEL] \t\tallocation %p was freed before its fault was handled", allocAddr);
+    return;
   }
+  if (owner < 0) { // not on any device yet, the host only fills the faulted chunk
+    log("[KERNEL] \t\tapplying pending fill of 0x%x to host=%p+%ld, writing back %ld+%ld", alloc->pendingFill->pattern, allocAddr,
+        entry->size, offset, length);
+    writeFill(static_cast<char *>(dst), length, offset % alloc->pendingFill->elementSize, alloc->pendingFill->pattern,
+              alloc->pendingFill->elementSize);
+    filledBytes.add(length);
+    alloc->history.faulted(0);
+    return;
+  }
+  auto devicePtr = static_cast<char *>(alloc->copies[owner].ptr);
+  log("[KERNEL] \t\tfound device ptr in fault handler  host=%p, device=%p+%ld (%d), fault is %p (offset=%lu), writing back %ld+%ld", //
+      allocAddr, devicePtr, entry->size, owner, faultAddr, reinterpret_cast<uintptr_t>(faultAddr) - reinterpret_cast<uintptr_t>(allocAddr),
+      offset, length);
+  if (auto result = stagingRing().download(dst, devicePtr + offset, length, nullptr); result != hipSuccess) {
+    log("[KERNEL] staged writeback failed: %d", result);
+  }
+  writtenBackBytes.add(length);
+  alloc->history.faulted(length);
   //
   //  fault::accessRegisteredPages([&](const auto &registeredPages) {
   //    log("[KERNEL] \tCurrent allocations: %d", registeredPages.size());
@@ -200,6 +988,24 @@ extern "C" [[maybe_unused]] void __attribute__((constructor)) preload_main() {
   originalHipMemAdvise = dlSymbol<_hipMemAdvise>("hipMemAdvise", HipLibrarySO);
   originalHipMalloc = dlSymbol<_hipMalloc>("hipMalloc", HipLibrarySO);
   originalHipMemcpy = dlSymbol<_hipMemcpy>("hipMemcpy", HipLibrarySO);
+  originalHipStreamAddCallback = dlSymbol<_hipStreamAddCallback>("hipStreamAddCallback", HipLibrarySO);
+  originalHipMemcpyAsync = dlSymbol<_hipMemcpyAsync>("hipMemcpyAsync", HipLibrarySO);
+  originalHipMemcpyPeerAsync = dlSymbol<_hipMemcpyPeerAsync>("hipMemcpyPeerAsync", HipLibrarySO);
+  originalHipMemcpy2D = dlSymbol<_hipMemcpy2D>("hipMemcpy2D", HipLibrarySO);
+  originalHipMemcpy2DAsync = dlSymbol<_hipMemcpy2DAsync>("hipMemcpy2DAsync", HipLibrarySO);
+  originalHipMemsetAsync = dlSymbol<_hipMemsetAsync>("hipMemsetAsync", HipLibrarySO);
+  originalHipMemsetD16Async = dlSymbol<_hipMemsetD16Async>("hipMemsetD16Async", HipLibrarySO);
+  originalHipMemsetD32Async = dlSymbol<_hipMemsetD32Async>("hipMemsetD32Async", HipLibrarySO);
+  originalHipMemset2DAsync = dlSymbol<_hipMemset2DAsync>("hipMemset2DAsync", HipLibrarySO);
+  originalHipFree = dlSymbol<_hipFree>("hipFree", HipLibrarySO);
+  originalHipHostMalloc = dlSymbol<_hipHostMalloc>("hipHostMalloc", HipLibrarySO);
+  originalHipHostRegister = dlSymbol<_hipHostRegister>("hipHostRegister", HipLibrarySO);
+  originalHipHostUnregister = dlSymbol<_hipHostUnregister>("hipHostUnregister", HipLibrarySO);
+  originalHipHostGetDevicePointer = dlSymbol<_hipHostGetDevicePointer>("hipHostGetDevicePointer", HipLibrarySO);
+  originalHipEventCreateWithFlags = dlSymbol<_hipEventCreateWithFlags>("hipEventCreateWithFlags", HipLibrarySO);
+  originalHipEventRecord = dlSymbol<_hipEventRecord>("hipEventRecord", HipLibrarySO);
+  originalHipEventSynchronize = dlSymbol<_hipEventSynchronize>("hipEventSynchronize", HipLibrarySO);
+  originalHipStreamWaitEvent = dlSymbol<_hipStreamWaitEvent>("hipStreamWaitEvent", HipLibrarySO);
   static const char *UTPX_MODE = "UTPX_MODE";
   if (auto modePtr = std::getenv(UTPX_MODE); modePtr) {
     std::string rawMode(modePtr);
@@ -217,16 +1023,34 @@ extern "C" [[maybe_unused]] void __attribute__((constructor)) preload_main() {
     case Mode::Device: log("Using Device mode"); break;
     case Mode::Mirror: log("Using Mirror mode"); break;
   }
+  if (auto speculate = std::getenv("UTPX_SPECULATIVE_WRITEBACK"); speculate) speculativeWriteBack = std::string(speculate) != "0";
+  deviceBudget = envBytes("UTPX_DEVICE_BUDGET", 0);
 }
 
-extern "C" [[maybe_unused]] void __attribute__((destructor)) preload_exit() { fault::terminateUserspacePagefaultHandling(); }
+extern "C" [[maybe_unused]] void __attribute__((destructor)) preload_exit() {
+  if (speculationThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(speculationLock);
+      speculationTerminate = true;
+    }
+    speculationReady.notify_one();
+    speculationThread.join();
+  }
+  fault::terminateUserspacePagefaultHandling();
+  if (auto file = std::getenv("UTPX_LEARN_FILE"); file && *file) {
+    std::lock_guard<std::mutex> guard(learnerLock);
+    if (!offsetLearner().save(file)) log("[LEARN] Cannot write %s", file);
+  }
+  if (std::getenv("UTPX_STATS")) stats::dump();
+}
 
 extern "C" [[maybe_unused]] hipError_t hipMallocManaged(void **ptr, size_t size, unsigned int flags) {
-  auto original = dlSymbol<_hipMallocManaged>("hipMallocManaged", HipLibrarySO);
+  static auto original = dlSymbol<_hipMallocManaged>("hipMallocManaged", HipLibrarySO);
   auto emplaceAlloc = [&](hipError_t result) {
     if (result == hipSuccess) {
-      std::unique_lock<std::shared_mutex> write(allocationsLock);
-      allocations.emplace(reinterpret_cast<uintptr_t>(*ptr), MirroredAllocation{.devicePtr = nullptr, .size = size});
+      auto hostPinned = mode == Mode::Mirror && hostArena().pinned(*ptr);
+      std::lock_guard<std::mutex> guard(registryLock);
+      registerAllocation(reinterpret_cast<uintptr_t>(*ptr), size, hostPinned, false);
     }
     return result;
   };
@@ -251,12 +1075,24 @@ extern "C" [[maybe_unused]] hipError_t hipMallocManaged(void **ptr, size_t size,
     case Mode::Device: return emplaceAlloc(originalHipMalloc(ptr, size));
     case Mode::Mirror: {
       if (size < fault::hostPageSize()) {
-        log("[MEM] Allocation (%zu) less than page size (%zu), skipping", size, fault::hostPageSize());
-        return original(ptr, size, flags);
+        std::lock_guard<std::mutex> slabGuard(slabLock);
+        if (!slabAllocator().packs(size)) {
+          log("[MEM] Allocation (%zu) less than page size (%zu), skipping", size, fault::hostPageSize());
+          return original(ptr, size, flags);
+        }
+        *ptr = slabAllocator().allocate(size, [](size_t slabSize) {
+          auto slab = hostArena().allocate(slabSize);
+          if (!slab) return slab;
+          auto hostPinned = hostArena().pinned(slab);
+          std::lock_guard<std::mutex> guard(registryLock);
+          registerAllocation(reinterpret_cast<uintptr_t>(slab), slabSize, hostPinned, true);
+          return slab;
+        });
+        if (!*ptr) return hipErrorOutOfMemory;
+        log("[MEM] Intercepting hipMallocManaged(%p, %ld, %x) -> %p in a slab", (void *)ptr, size, flags, *ptr);
+        return hipSuccess;
       }
-      //  auto r = original(ptr, size + 4096 , flags);
-      *ptr = aligned_alloc(fault::hostPageSize(),
-                           size + fault::hostPageSize()); // XXX burn extra page worth of memory so that we don't lock the wrong thing
+      *ptr = hostArena().allocate(size);
       if (!*ptr) return hipErrorOutOfMemory;
       log("[MEM] Intercepting hipMallocManaged(%p, %ld, %x)", (void *)ptr, size, flags);
       log("[MEM]  -> %p ", *ptr);
@@ -272,90 +1108,273 @@ extern "C" [[maybe_unused]] hipError_t hipMallocManaged(void **ptr, size_t size,
 
 // thread_local bool __hipstdpar_dealloc_active = false;
 
+// A copy between a device copy and memory that isn't mirrored, staged if that is host memory, and ordered on stream unless it is
+// synchronous. A host range that runs into a mirrored allocation is copied directly instead, as it may be protected and faulting on it
+// while holding the staging ring stalls the write back.
+static hipError_t copyUnmirrored(const Registry &registry, void *dst, const void *src, size_t size, hipMemcpyKind kind, hipStream_t stream,
+                                 bool async) {
+  auto copy = [&]() { return async ? originalHipMemcpyAsync(dst, src, size, kind, stream) : originalHipMemcpy(dst, src, size, kind); };
+  if (kind != hipMemcpyHostToDevice && kind != hipMemcpyDeviceToHost) return copy();
+  auto host = reinterpret_cast<uintptr_t>(kind == hipMemcpyHostToDevice ? src : dst);
+  if (findHostAllocations(registry, host) != registry.allocations.end() ||
+      findHostAllocations(registry, host + size - 1) != registry.allocations.end())
+    return copy();
+  if (kind == hipMemcpyDeviceToHost) return stagingRing().download(dst, src, size, stream);
+  if (auto result = stagingRing().upload(dst, src, size, stream); result != hipSuccess) return result;
+  return async ? hipSuccess : stagingRing().drain(); // hipMemcpy only returns once the copy is complete
+}
+
+// The mirrored allocation that [ptr, ptr + extent), one end of a copy, lies within and the offset of ptr into it. Returns nullptr if there
+// is none, a range that runs past the end of an allocation is left to the runtime.
+static std::pair<const IntervalMap<RegistryEntry>::Entry *, size_t> findMirroredEndpoint(const Registry &registry, const void *ptr,
+                                                                                         size_t extent) {
+  auto address = reinterpret_cast<uintptr_t>(ptr);
+  if (auto it = findHostAllocations(registry, address); it != registry.allocations.end() && address - it->base + extent <= it->size)
+    return {&*it, address - it->base};
+  return {nullptr, 0};
+}
+
+// Makes sure the destination of a copy or fill has a copy on device that is current outside of the range it writes, unless it overwrites
+// the whole allocation, and makes it the owner. Slabs are always copied into partially, and must not lose the other slots.
+static void prepareDestination(MirroredAllocation &alloc, uintptr_t base, bool overwritten, int device, hipStream_t stream) {
+  if (!alloc.copies[device].ptr) alloc.create(device);
+  if (overwritten) {
+    alloc.pendingFill.reset();
+    alloc.owner = device;
+    return;
+  }
+  alloc.moveTo(device, stream);
+  if (!alloc.flush(device, base, stream)) alloc.mirror(device, reinterpret_cast<void *>(base), 0, alloc.size, stream);
+}
+
+// Runs a copy of height rows of width bytes, pitch bytes apart at either end, on the device copies of the mirrored allocations it reads or
+// writes, for every hipMemcpy variant. A synchronous copy completes before this returns, like hipMemcpy, an asynchronous one is ordered on
+// stream like the uploads that bring the device copies up to date. The destination's host range is protected again afterwards, so that
+// the host sees the copy on its next access. Returns nothing if neither end is mirrored, the caller then passes the copy on unchanged.
+static std::optional<hipError_t> copyMirrored(void *dst, size_t dpitch, const void *src, size_t spitch, size_t width, size_t height,
+                                              hipMemcpyKind kind, hipStream_t stream, bool async) {
+  // host to host copies are left to the fault handler, like any other host access
+  if (mode != Mode::Mirror || kind == hipMemcpyHostToHost || width == 0 || height == 0) return std::nullopt;
+  RegistryView view;
+  const auto [srcEntry, srcOffset] = findMirroredEndpoint(*view, src, spitch * (height - 1) + width);
+  const auto [dstEntry, dstOffset] = findMirroredEndpoint(*view, dst, dpitch * (height - 1) + width);
+  if (!srcEntry && !dstEntry) return std::nullopt;
+  auto srcAlloc = srcEntry ? srcEntry->value.alloc : nullptr;
+  auto dstAlloc = dstEntry ? dstEntry->value.alloc : nullptr;
+  // Both allocations are locked for the whole copy, at once so that copies in opposite directions can't deadlock. An endpoint freed by
+  // another thread in the meantime is copied as if it were unmirrored.
+  std::unique_lock<std::shared_mutex> srcLock, dstLock;
+  if (srcAlloc) srcLock = std::unique_lock<std::shared_mutex>(srcAlloc->lock, std::defer_lock);
+  if (dstAlloc && dstAlloc != srcAlloc) dstLock = std::unique_lock<std::shared_mutex>(dstAlloc->lock, std::defer_lock);
+  if (srcLock.mutex() && dstLock.mutex()) std::lock(srcLock, dstLock);
+  else if (srcLock.mutex())
+    srcLock.lock();
+  else if (dstLock.mutex())
+    dstLock.lock();
+  // mapped allocations are plain pinned host memory to the runtime
+  bool srcMirrored = srcAlloc && srcAlloc->incarnation == srcEntry->value.incarnation && !srcAlloc->mapped;
+  bool dstMirrored = dstAlloc && dstAlloc->incarnation == dstEntry->value.incarnation && !dstAlloc->mapped;
+  if (!srcMirrored && !dstMirrored) return std::nullopt;
+  log("Intercepting %s copy(%p, %zu, %p, %zu, %zu x %zu, kind=%d), dst=[host=%p;owner=%d], src=[host=%p;owner=%d]", //
+      async ? "async" : "sync", dst, dpitch, src, spitch, width, height, kind,                                     //
+      dstMirrored ? reinterpret_cast<void *>(dstEntry->base) : nullptr, dstMirrored ? dstAlloc->owner.load() : -1, //
+      srcMirrored ? reinterpret_cast<void *>(srcEntry->base) : nullptr, srcMirrored ? srcAlloc->owner.load() : -1);
+
+  // The source is read from whichever device owns it, or from the host if it has no device copy, because it was never launched or has
+  // been evicted. A source with a pending fill is filled on the current device first, as the runtime can't fault its host range in. The
+  // destination is written on the current device. An end that isn't mirrored keeps the kind the caller gave it, where the kind says
+  // which, so that host memory is staged.
+  if (srcMirrored && srcAlloc->pendingFill) prepareDestination(*srcAlloc, srcEntry->base, false, currentDevice(), stream);
+  auto from = src;
+  auto srcDevice = srcMirrored ? srcAlloc->current(srcEntry->base, stream) : nullptr;
+  if (srcDevice) from = srcDevice + srcOffset;
+  auto to = dst;
+  if (dstMirrored) {
+    auto device = currentDevice();
+    bool overwritten = dstOffset == 0 && (height == 1 || dpitch == width) && width * height == dstEntry->size;
+    prepareDestination(*dstAlloc, dstEntry->base, overwritten, device, stream);
+    to = static_cast<char *>(dstAlloc->copies[device].ptr) + dstOffset;
+  }
+  auto actual = hipMemcpyDefault;
+  if (srcDevice && !dstMirrored && kind == hipMemcpyDeviceToHost) actual = hipMemcpyDeviceToHost;
+  if (dstMirrored && !srcMirrored && kind == hipMemcpyHostToDevice) actual = hipMemcpyHostToDevice;
+
+  hipError_t result;
+  if (height == 1) result = copyUnmirrored(*view, to, from, width, actual, stream, async);
+  else if (async)
+    result = originalHipMemcpy2DAsync(to, dpitch, from, spitch, width, height, actual, stream);
+  else
+    result = originalHipMemcpy2D(to, dpitch, from, spitch, width, height, actual);
+  if (dstMirrored) fault::registerPage(reinterpret_cast<void *>(dstEntry->base), dstEntry->size, &dstAlloc->settled);
+  return result;
+}
+
 extern "C" [[maybe_unused]] hipError_t hipMemcpy(void *dst, const void *src, size_t size, hipMemcpyKind kind) {
-  auto original = dlSymbol<_hipMemcpy>("hipMemcpy", HipLibrarySO);
-  switch (mode) {
-    case Mode::Advise: return original(dst, src, size, kind);
-    case Mode::Device: return original(dst, src, size, hipMemcpyDefault);
-    case Mode::Mirror:
-      switch (kind) {
-        case hipMemcpyHostToHost: // fallthrough
-        case hipMemcpyDeviceToDevice: return original(dst, src, size, kind);
-        case hipMemcpyDefault:      // fallthrough
-        case hipMemcpyHostToDevice: // fallthrough
-        case hipMemcpyDeviceToHost: {
-          const auto kindName = [](hipMemcpyKind kind) {
-            switch (kind) {
-              case hipMemcpyHostToHost: return "MemcpyHostToHost";
-              case hipMemcpyDeviceToDevice: return "MemcpyDeviceToDevice";
-              case hipMemcpyDefault: return "MemcpyDefault";
-              case hipMemcpyHostToDevice: return "MemcpyHostToDevice";
-              case hipMemcpyDeviceToHost: return "MemcpyDeviceToHost";
-              default: return "Unknown";
-            }
-          };
-          auto srcIt = allocations.find(reinterpret_cast<uintptr_t>(src));
-          auto dstIt = allocations.find(reinterpret_cast<uintptr_t>(dst));
-          if (srcIt != allocations.end() && dstIt != allocations.end()) {
-            log("Intercepting hipMemcpy(%p, %p, %zu, %s) , dst=[host=%p;device=%p], src=[host=%p;device=%p]", //
-                dst, src, size, kindName(kind),                                                               //
-                reinterpret_cast<void *>(dstIt->first), reinterpret_cast<void *>(dstIt->second.devicePtr),
-                reinterpret_cast<void *>(srcIt->first), reinterpret_cast<void *>(srcIt->second.devicePtr));
-            auto result = original(dstIt->second.devicePtr, srcIt->second.devicePtr, size, kind);
-            fault::registerPage(reinterpret_cast<void *>(dstIt->first), dstIt->second.size);
-            return result;
-          } else if (srcIt != allocations.end()) {                                           // the source ptr is mirrored, and dest is not:
-            log("Intercepting hipMemcpy(%p, %p, %zu, %s) , dst=%p, src=[host=%p;device=%p]", //
-                dst, src, size, kindName(kind), dst, reinterpret_cast<void *>(srcIt->first),
-                reinterpret_cast<void *>(srcIt->second.devicePtr));
-            // just copy to the dest (host/device) ptr, we use the device pointer as the source as it's always up-to-date
-            return original(dst, srcIt->second.devicePtr, size, kind);
-          } else if (dstIt != allocations.end()) {                                           // dest ptr is mirrored, and the source is not:
-            log("Intercepting hipMemcpy(%p, %p, %zu, %s) , dst=[host=%p;device=%p], src=%p", //
-                dst, src, size, kindName(kind), reinterpret_cast<void *>(dstIt->first), reinterpret_cast<void *>(dstIt->second.devicePtr),
-                src);
-            // just copy to the device ptr and register the host page if not already registered, synchronisation happens on next page fault
-            if (!dstIt->second.devicePtr) dstIt->second.create();
-            auto result = original(dstIt->second.devicePtr, src, size, kind);
-            fault::registerPage(reinterpret_cast<void *>(dstIt->first), dstIt->second.size);
-            return result;
-          } else {
-            return original(dst, src, size, kind);
-          }
-        }
-        default: return original(dst, src, size, kind);
-      }
+  if (mode == Mode::Device) return originalHipMemcpy(dst, src, size, hipMemcpyDefault);
+  if (auto result = copyMirrored(dst, size, src, size, size, 1, kind, nullptr, false)) return *result;
+  return originalHipMemcpy(dst, src, size, kind);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpyAsync(void *dst, const void *src, size_t size, hipMemcpyKind kind, hipStream_t stream) {
+  if (auto result = copyMirrored(dst, size, src, size, size, 1, kind, stream, true)) return *result;
+  return originalHipMemcpyAsync(dst, src, size, kind, stream);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpy2D(void *dst, size_t dpitch, const void *src, size_t spitch, size_t width, size_t height,
+                                                   hipMemcpyKind kind) {
+  if (auto result = copyMirrored(dst, dpitch, src, spitch, width, height, kind, nullptr, false)) return *result;
+  return originalHipMemcpy2D(dst, dpitch, src, spitch, width, height, kind);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpy2DAsync(void *dst, size_t dpitch, const void *src, size_t spitch, size_t width,
+                                                        size_t height, hipMemcpyKind kind, hipStream_t stream) {
+  if (auto result = copyMirrored(dst, dpitch, src, spitch, width, height, kind, stream, true)) return *result;
+  return originalHipMemcpy2DAsync(dst, dpitch, src, spitch, width, height, kind, stream);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpyHtoD(hipDeviceptr_t dst, void *src, size_t size) {
+  static auto original = dlSymbol<_hipMemcpyHtoD>("hipMemcpyHtoD", HipLibrarySO);
+  if (auto result = copyMirrored(dst, size, src, size, size, 1, hipMemcpyHostToDevice, nullptr, false)) return *result;
+  return original(dst, src, size);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpyDtoH(void *dst, hipDeviceptr_t src, size_t size) {
+  static auto original = dlSymbol<_hipMemcpyDtoH>("hipMemcpyDtoH", HipLibrarySO);
+  if (auto result = copyMirrored(dst, size, src, size, size, 1, hipMemcpyDeviceToHost, nullptr, false)) return *result;
+  return original(dst, src, size);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpyDtoD(hipDeviceptr_t dst, hipDeviceptr_t src, size_t size) {
+  static auto original = dlSymbol<_hipMemcpyDtoD>("hipMemcpyDtoD", HipLibrarySO);
+  if (auto result = copyMirrored(dst, size, src, size, size, 1, hipMemcpyDeviceToDevice, nullptr, false)) return *result;
+  return original(dst, src, size);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpyHtoDAsync(hipDeviceptr_t dst, void *src, size_t size, hipStream_t stream) {
+  static auto original = dlSymbol<_hipMemcpyHtoDAsync>("hipMemcpyHtoDAsync", HipLibrarySO);
+  if (auto result = copyMirrored(dst, size, src, size, size, 1, hipMemcpyHostToDevice, stream, true)) return *result;
+  return original(dst, src, size, stream);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpyDtoHAsync(void *dst, hipDeviceptr_t src, size_t size, hipStream_t stream) {
+  static auto original = dlSymbol<_hipMemcpyDtoHAsync>("hipMemcpyDtoHAsync", HipLibrarySO);
+  if (auto result = copyMirrored(dst, size, src, size, size, 1, hipMemcpyDeviceToHost, stream, true)) return *result;
+  return original(dst, src, size, stream);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemcpyDtoDAsync(hipDeviceptr_t dst, hipDeviceptr_t src, size_t size, hipStream_t stream) {
+  static auto original = dlSymbol<_hipMemcpyDtoDAsync>("hipMemcpyDtoDAsync", HipLibrarySO);
+  if (auto result = copyMirrored(dst, size, src, size, size, 1, hipMemcpyDeviceToDevice, stream, true)) return *result;
+  return original(dst, src, size, stream);
+}
+
+// Runs a fill of height rows of width bytes, pitch bytes apart, for every hipMemset variant. A fill of a whole allocation that no device
+// owns is only recorded, and its range registered so that the next kernel launch fills the device copy and a host access fills just the
+// chunk it faults on. A fill of an allocation that a device owns runs on that device, ordered on stream, and any other fill writes the
+// host range, from where the next launch uploads it like any host write. Returns nothing if ptr isn't mirrored, the caller then passes
+// the fill on unchanged.
+static std::optional<hipError_t> fillMirrored(void *ptr, size_t pitch, size_t width, size_t height, uint32_t pattern, size_t elementSize,
+                                              hipStream_t stream) {
+  if (mode != Mode::Mirror || width == 0 || height == 0) return std::nullopt;
+  RegistryView view;
+  auto [it, offset] = findMirroredEndpoint(*view, ptr, pitch * (height - 1) + width);
+  if (!it) return std::nullopt;
+  auto fillHost = [&]() {
+    for (size_t row = 0; row < height; ++row)
+      writeFill(static_cast<char *>(ptr) + row * pitch, width, 0, pattern, elementSize);
+    return hipSuccess;
+  };
+  auto &alloc = *it->value.alloc;
+  // a slab is written back by the host writes and uploaded before its next launch, like any other host write
+  if (alloc.slab) return fillHost();
+  auto lock = lockCurrent(it->value);
+  if (!lock) return std::nullopt;
+  bool whole = offset == 0 && (height == 1 || pitch == width) && width * height == it->size;
+  auto owner = alloc.owner.load();
+  log("Intercepting fill(%p, %zu, %zu x %zu, 0x%x/%zu), host=%p, owner=%d, whole=%d", ptr, pitch, width, height, pattern, elementSize,
+      reinterpret_cast<void *>(it->base), owner, whole);
+  if (auto mapped = alloc.mapped.load(); mapped) return deviceFill(mapped + offset, pitch, width, height, pattern, elementSize, stream);
+  if (owner < 0) {
+    if (!whole) { // faults in whatever the host doesn't have yet, including any pending fill, so the handler needs the lock
+      lock.unlock();
+      return fillHost();
+    }
+    alloc.pendingFill = Fill{.pattern = pattern, .elementSize = elementSize};
+    fault::registerPage(reinterpret_cast<void *>(it->base), it->size, &alloc.settled); // drops whatever the host had
+    return hipSuccess;
   }
-  return hipErrorInvalidValue;
+  // what the host wrote since the last launch is uploaded first unless the fill overwrites it all, it is then only protected again
+  if (whole) fault::registerPage(reinterpret_cast<void *>(it->base), it->size, &alloc.settled);
+  else
+    alloc.flush(owner, it->base, stream);
+  auto device = static_cast<char *>(alloc.copies[owner].ptr) + offset;
+  auto result = deviceFill(device, pitch, width, height, pattern, elementSize, stream);
+  if (result != hipSuccess)
+    log("fill(%p, %zu, %zu x %zu, 0x%x) of mirrored allocation failed with %d", device, pitch, width, height, pattern, result);
+  return result;
 }
 
 extern "C" [[maybe_unused]] hipError_t hipMemset(void *ptr, int value, size_t size) {
-  auto original = dlSymbol<_hipMemset>("hipMemset", HipLibrarySO);
-  switch (mode) {
-    case Mode::Advise: // fallthrough
-    case Mode::Device: return original(ptr, value, size);
-    case Mode::Mirror:
-      // XXX ptr may be an offset from base we need to do a ranged search
-      std::shared_lock<std::shared_mutex> read(allocationsLock);
-      if (auto it = findHostAllocations(reinterpret_cast<uintptr_t>(ptr)); it != allocations.end()) {
-        log("Intercepting hipMemset(%p, %d, %ld), existing host allocation found", ptr, value, size);
-        size_t offsetFromBase = reinterpret_cast<uintptr_t>(ptr) - it->first;
-        if (offsetFromBase != 0) fatal("IMPL: hipMemset with offset\n");
-        std::memset(ptr, value, size);                  // memset the host using the already offset ptr from the arg
-        if (!it->second.devicePtr) it->second.create(); // XXX devicePtr is nullptr if memset is called before any dependent kernel
-        if (auto result = original(it->second.devicePtr, value, size); result != hipSuccess) {
-          fatal("hipMemset(%p, %d, %ld) failed to memset mirrored allocation: %d", it->second.devicePtr, value, size, result);
-        }
-        return hipSuccess;
-      } else {
-        return original(ptr, value, size);
-      }
-  }
-  return hipErrorInvalidValue;
+  if (auto result = fillMirrored(ptr, size, size, 1, uint8_t(value), 1, nullptr)) return *result;
+  static auto original = dlSymbol<_hipMemset>("hipMemset", HipLibrarySO);
+  return original(ptr, value, size);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemsetAsync(void *ptr, int value, size_t size, hipStream_t stream) {
+  if (auto result = fillMirrored(ptr, size, size, 1, uint8_t(value), 1, stream)) return *result;
+  return originalHipMemsetAsync(ptr, value, size, stream);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemset2D(void *ptr, size_t pitch, int value, size_t width, size_t height) {
+  if (auto result = fillMirrored(ptr, pitch, width, height, uint8_t(value), 1, nullptr)) return *result;
+  static auto original = dlSymbol<_hipMemset2D>("hipMemset2D", HipLibrarySO);
+  return original(ptr, pitch, value, width, height);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemset2DAsync(void *ptr, size_t pitch, int value, size_t width, size_t height,
+                                                        hipStream_t stream) {
+  if (auto result = fillMirrored(ptr, pitch, width, height, uint8_t(value), 1, stream)) return *result;
+  return originalHipMemset2DAsync(ptr, pitch, value, width, height, stream);
+}
+
+// Like the copies, the element-sized variants are resolved here where their signatures are shared. Counts are in elements.
+
+extern "C" [[maybe_unused]] hipError_t hipMemsetD8(hipDeviceptr_t ptr, unsigned char value, size_t count) {
+  static auto original = dlSymbol<_hipMemsetD8>("hipMemsetD8", HipLibrarySO);
+  if (auto result = fillMirrored(ptr, count, count, 1, value, 1, nullptr)) return *result;
+  return original(ptr, value, count);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemsetD16(hipDeviceptr_t ptr, unsigned short value, size_t count) {
+  static auto original = dlSymbol<_hipMemsetD16>("hipMemsetD16", HipLibrarySO);
+  if (auto result = fillMirrored(ptr, count * 2, count * 2, 1, value, 2, nullptr)) return *result;
+  return original(ptr, value, count);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemsetD32(hipDeviceptr_t ptr, int value, size_t count) {
+  static auto original = dlSymbol<_hipMemsetD32>("hipMemsetD32", HipLibrarySO);
+  if (auto result = fillMirrored(ptr, count * 4, count * 4, 1, uint32_t(value), 4, nullptr)) return *result;
+  return original(ptr, value, count);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemsetD8Async(hipDeviceptr_t ptr, unsigned char value, size_t count, hipStream_t stream) {
+  static auto original = dlSymbol<_hipMemsetD8Async>("hipMemsetD8Async", HipLibrarySO);
+  if (auto result = fillMirrored(ptr, count, count, 1, value, 1, stream)) return *result;
+  return original(ptr, value, count, stream);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemsetD16Async(hipDeviceptr_t ptr, unsigned short value, size_t count, hipStream_t stream) {
+  if (auto result = fillMirrored(ptr, count * 2, count * 2, 1, value, 2, stream)) return *result;
+  return originalHipMemsetD16Async(ptr, value, count, stream);
+}
+
+extern "C" [[maybe_unused]] hipError_t hipMemsetD32Async(hipDeviceptr_t ptr, int value, size_t count, hipStream_t stream) {
+  if (auto result = fillMirrored(ptr, count * 4, count * 4, 1, uint32_t(value), 4, stream)) return *result;
+  return originalHipMemsetD32Async(ptr, value, count, stream);
 }
 
 extern "C" [[maybe_unused]] hipError_t hipFree(void *ptr) {
-  auto original = dlSymbol<_hipFree>("hipFree", HipLibrarySO);
+  static auto original = dlSymbol<_hipFree>("hipFree", HipLibrarySO);
   switch (mode) {
     case Mode::Advise: // fallthrough
     case Mode::Device: return original(ptr);
@@ -363,18 +1382,40 @@ extern "C" [[maybe_unused]] hipError_t hipFree(void *ptr) {
       if (!ptr)
         return original(nullptr); // XXX still delegate to HIP because hipFree(nullptr) can be used as an implicit hipDeviceSynchronize or
                                   // initialisation of the HIP runtime
-      std::unique_lock<std::shared_mutex> write(allocationsLock);
-      if (auto it = allocations.find(reinterpret_cast<uintptr_t>(ptr)); it != allocations.end()) {
-        log("Intercepting hipFree(%p), existing host allocation found", ptr);
-
-        if (auto page = fault::lookupRegisteredPage(ptr); page) {
+      RegistryView view;
+      auto release = [](const IntervalMap<RegistryEntry>::Entry &entry) {
+        auto lock = lockCurrent(entry.value);
+        if (!lock) return; // freed by another thread in the meantime
+        if (auto page = fault::lookupRegisteredPage(reinterpret_cast<void *>(entry.base)); page) {
           fault::unregisterPage(page->first);
         }
-        free(ptr);
-        if (auto result = original(it->second.devicePtr); result != hipSuccess) {
-          fatal("hipFree(%p) failed to release mirrored allocation: %d", it->second.devicePtr, result);
+        entry.value.alloc->owner = -1;
+        entry.value.alloc->pendingFill.reset();
+        if (entry.value.alloc->mapped && !entry.value.alloc->hostPinned) originalHipHostUnregister(reinterpret_cast<void *>(entry.base));
+        entry.value.alloc->mapped = nullptr;
+        auto current = currentDevice();
+        for (int device = 0; device < MaxDevices; ++device)
+          entry.value.alloc->destroy(device, current);
+        {
+          std::lock_guard<std::mutex> guard(registryLock);
+          unregisterAllocation(entry.base, entry.value.alloc);
         }
-        allocations.erase(it);
+        // only once unregistered, as the arena may hand the range out again right away
+        hostArena().release(reinterpret_cast<void *>(entry.base));
+      };
+      {
+        // checked first, as the first slot of a slab shares its address with the slab itself
+        std::lock_guard<std::mutex> slabGuard(slabLock);
+        if (auto emptied = slabAllocator().release(ptr); emptied) {
+          log("Intercepting hipFree(%p), slab slot found", ptr);
+          if (*emptied)
+            if (auto it = view->allocations.find(reinterpret_cast<uintptr_t>(*emptied)); it != view->allocations.end()) release(*it);
+          return hipSuccess;
+        }
+      }
+      if (auto it = view->allocations.find(reinterpret_cast<uintptr_t>(ptr)); it != view->allocations.end() && !it->value.alloc->slab) {
+        log("Intercepting hipFree(%p), existing host allocation found", ptr);
+        release(*it);
         return hipSuccess;
       } else {
         return original(ptr);
@@ -384,15 +1425,15 @@ extern "C" [[maybe_unused]] hipError_t hipFree(void *ptr) {
 }
 
 extern "C" [[maybe_unused]] hipError_t hipPointerGetAttributes(hipPointerAttribute_t *attributes, const void *ptr) {
-  auto original = dlSymbol<_hipPointerGetAttributes>("hipPointerGetAttributes", HipLibrarySO);
+  static auto original = dlSymbol<_hipPointerGetAttributes>("hipPointerGetAttributes", HipLibrarySO);
   switch (mode) {
     case Mode::Advise: return original(attributes, ptr);
     case Mode::Device: // fallthrough
     case Mode::Mirror:
       log("Replace hipPointerGetAttributes(%p, %p), isManaged=%d", attributes, ptr, attributes->isManaged);
       auto result = original(attributes, ptr);
-      std::shared_lock<std::shared_mutex> read(allocationsLock);
-      if (auto it = findHostAllocations(reinterpret_cast<uintptr_t>(ptr)); it != allocations.end()) {
+      RegistryView view;
+      if (auto it = findHostAllocations(*view, reinterpret_cast<uintptr_t>(ptr)); it != view->allocations.end()) {
         log(" -> Replace hipPointerGetAttributes(%p, %p), isManaged=%d", attributes, ptr, attributes->isManaged);
       }
       attributes->isManaged = true; // FIXME we should only do this if allocation is found really, but it crashes a few apps early
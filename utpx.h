@@ -1,8 +1,12 @@
 #pragma once
 
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <dlfcn.h>
+#include <functional>
+#include <string>
 #include <unistd.h>
 
 namespace utpx {
@@ -26,31 +30,74 @@ void log(const char *fmt, ...);
 
 #endif
 
-template <typename T> T dlSymbol(const char *symbol_name, const char *so) {
-  static T fn;
-  if (!fn) {
-    fn = (T)dlsym(RTLD_NEXT, symbol_name);
-    if (fn) log("[DLSYM] Found %s at %p", symbol_name, (void *)fn);
-    else {
-      if (!so) {
-        log("[DLSYM] Missing original %s and no library is specified to find this symbol, terminating...", symbol_name);
-        std::abort();
-      }
-      log("[DLSYM] Missing original %s, trying to load directly from %s", symbol_name, so);
-      auto handle = dlopen(so, RTLD_LAZY);
-      if (!handle) {
-        log("[DLSYM] dlopen failed for %s when resolving for %s, reason=%s, terminating...", so, symbol_name, dlerror());
-        std::abort();
-      }
-      dlerror(); // clear existing errors
-      fn = (T)dlsym(handle, symbol_name);
-      if (auto e = dlerror(); e) {
-        log("[DLSYM] dlsym failed for %s, reason=%s, terminating...", symbol_name, e);
-        std::abort();
-      }
+inline void *dlResolve(const char *symbol_name, const char *so) {
+  auto fn = dlsym(RTLD_NEXT, symbol_name);
+  if (fn) log("[DLSYM] Found %s at %p", symbol_name, fn);
+  else {
+    if (!so) {
+      log("[DLSYM] Missing original %s and no library is specified to find this symbol, terminating...", symbol_name);
+      std::abort();
+    }
+    log("[DLSYM] Missing original %s, trying to load directly from %s", symbol_name, so);
+    auto handle = dlopen(so, RTLD_LAZY);
+    if (!handle) {
+      log("[DLSYM] dlopen failed for %s when resolving for %s, reason=%s, terminating...", so, symbol_name, dlerror());
+      std::abort();
+    }
+    dlerror(); // clear existing errors
+    fn = dlsym(handle, symbol_name);
+    if (auto e = dlerror(); e) {
+      log("[DLSYM] dlsym failed for %s, reason=%s, terminating...", symbol_name, e);
+      std::abort();
     }
   }
   return fn;
 }
 
+// Resolves on every call, callers keep the result (e.g. in a function-local static) as several functions share a type, such as hipFree and
+// hipHostUnregister, so there is no one function per type to cache here.
+template <typename T> T dlSymbol(const char *symbol_name, const char *so) { return reinterpret_cast<T>(dlResolve(symbol_name, so)); }
+
+// Reads a byte count such as 4096, 64K, 2M or 1G from the environment, returns fallback if the variable is not set.
+inline size_t envBytes(const char *name, size_t fallback) {
+  auto value = std::getenv(name);
+  if (!value || !*value) return fallback;
+  char *end{};
+  size_t bytes = std::strtoull(value, &end, 10);
+  switch (*end) {
+    case 'G': case 'g': bytes <<= 10; [[fallthrough]];
+    case 'M': case 'm': bytes <<= 10; [[fallthrough]];
+    case 'K': case 'k': bytes <<= 10; ++end; break;
+    default: break;
+  }
+  if (end == value || *end != '\0') fatal("Cannot parse %s=%s as a byte count, terminating...", name, value);
+  return bytes;
+}
+
+// Reads a plain number, such as a count, percentage or duration, from the environment, returns fallback if the variable is not set. Unlike
+// envBytes this takes no suffix, so that 1K isn't silently read as 1024 threads.
+inline size_t envCount(const char *name, size_t fallback) {
+  auto value = std::getenv(name);
+  if (!value || !*value) return fallback;
+  char *end{};
+  size_t count = std::strtoull(value, &end, 10);
+  if (end == value || *end != '\0') fatal("Cannot parse %s=%s as a number, terminating...", name, value);
+  return count;
+}
+
+// Replaces path with what write puts in the file it is given, returns false with errno set if write or any file operation fails. The file
+// is written under a unique name and renamed into place, so that concurrent jobs sharing it never see a partial one.
+inline bool writeFileAtomically(const std::string &path, const std::function<bool(std::FILE *)> &write) {
+  auto temporary = path + ".tmp." + std::to_string(getpid());
+  auto file = std::fopen(temporary.c_str(), "w");
+  if (!file) return false;
+  bool written = write(file) && std::ferror(file) == 0;
+  written &= std::fclose(file) == 0;
+  if (written && std::rename(temporary.c_str(), path.c_str()) == 0) return true;
+  auto error = errno;
+  unlink(temporary.c_str());
+  errno = error;
+  return false;
+}
+
 } // namespace utpx